@@ -33,7 +33,20 @@
 #include <linux/oprofile.h>
 #endif // RRPROFILE
 #include <linux/sched.h>
+#ifdef RRPROFILE
+#include <linux/version.h>
+#include <linux/smp.h>
+#include <linux/jiffies.h>
+#include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/cpu.h>
+#include <linux/completion.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <asm/div64.h>
+#endif // RRPROFILE
 
+#include "oprof.h"
 #include "oprofile_stats.h"
 #include "event_buffer.h"
 #include "cpu_buffer.h"
@@ -53,6 +66,12 @@ static cpumask_t marked_cpus = CPU_MASK_NONE;
 #ifndef RRPROFILE
 static DEFINE_SPINLOCK(task_mortuary);
 static void process_task_mortuary(void);
+#else
+static int merge_reset(void);
+static void merge_exit(void);
+static void drain_init(void);
+static void drain_exit(void);
+static struct notifier_block module_load_nb;
 #endif // !RRPROFILE
 
 #ifndef RRPROFILE
@@ -171,9 +190,20 @@ int sync_start(void)
 {
 	int err;
 
+#ifdef RRPROFILE
+	err = merge_reset();
+	if (err)
+		return err;
+	drain_init();
+#endif // RRPROFILE
 	start_cpu_work();
 #ifdef RRPROFILE
-	err = 0;
+	err = register_module_notifier(&module_load_nb);
+	if (err) {
+		end_sync();
+		drain_exit();
+		merge_exit();
+	}
 	return err;
 
 #else
@@ -212,8 +242,14 @@ void sync_stop(void)
 	profile_event_unregister(PROFILE_MUNMAP, &munmap_nb);
 	profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
 	task_handoff_unregister(&task_free_nb);
+#else
+	unregister_module_notifier(&module_load_nb);
 #endif // !RRPROFILE
 	end_sync();
+#ifdef RRPROFILE
+	drain_exit();
+	merge_exit();
+#endif // RRPROFILE
 }
 
 #ifndef RRPROFILE
@@ -366,6 +402,179 @@ static void add_trace_begin(void)
 	add_event_entry(TRACE_BEGIN_CODE);
 }
 
+#ifdef RRPROFILE
+/* 64-bit values are split into two entries on 32-bit kernels,
+ * high word first.
+ */
+static void add_u64_entry(uint64_t value)
+{
+	if(sizeof(unsigned long) == 8) {
+		add_event_entry(value);
+	} else {
+		add_event_entry(value >> 32);
+		add_event_entry(value);
+	}
+}
+
+/* Convert a delta in timebase ticks to nsecs at the given rate. */
+static uint64_t tb_delta_to_ns(uint64_t delta, unsigned long khz)
+{
+	uint64_t rem;
+
+	if (!khz)
+		return 0;
+
+	rem = do_div(delta, khz);
+	rem *= 1000000;
+	do_div(rem, khz);
+	return delta * 1000000 + rem;
+}
+
+/* Map a raw timestamp of the given CPU onto CLOCK_MONOTONIC, using the
+ * CPU's latest correlation point and its measured timebase rate.
+ */
+static uint64_t tb_to_ns(int cpu, uint64_t tb)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+
+	if (tb >= b->clock_tb)
+		return b->clock_ns + tb_delta_to_ns(tb - b->clock_tb, b->clock_khz);
+	return b->clock_ns - tb_delta_to_ns(b->clock_tb - tb, b->clock_khz);
+}
+
+static void add_timestamp_entry(int cpu, unsigned long code, uint64_t timestamp)
+{
+	add_event_entry(ESCAPE_CODE);
+	add_event_entry(code);
+	add_u64_entry(oprofile_timestamp_ns ? tb_to_ns(cpu, timestamp) : timestamp);
+}
+
+struct clock_sample {
+	uint64_t tb;
+	uint64_t mono;
+	uint64_t real;
+};
+
+static void read_clock(void *data)
+{
+	struct clock_sample *cs = data;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+	cs->mono = ktime_to_ns(ktime_get());
+	cs->tb = oprofile_get_tb();
+	cs->real = ktime_to_ns(ktime_get_real());
+#else
+	struct timespec ts;
+
+	do_posix_clock_monotonic_gettime(&ts);
+	cs->mono = timespec_to_ns(&ts);
+	cs->tb = oprofile_get_tb();
+	getnstimeofday(&ts);
+	cs->real = timespec_to_ns(&ts);
+#endif
+}
+
+/* Sample the CPU's timebase together with CLOCK_MONOTONIC and
+ * CLOCK_REALTIME and record the triple in the event buffer. The
+ * timebase rate of the CPU is re-measured against CLOCK_MONOTONIC
+ * at every correlation point, so hosts without an invariant TSC are
+ * accounted at the rate the CPU actually ran at.
+ */
+void sync_clock(int cpu)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+	struct clock_sample cs;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	if (smp_call_function_single(cpu, read_clock, &cs, 1))
+#else
+	if (smp_call_function_single(cpu, read_clock, &cs, 0, 1))
+#endif
+		return;
+
+	down(&buffer_sem);
+
+	/* ticks per msec between the last two points, if the interval
+	 * is short enough not to overflow */
+	if (b->clock_tb && cs.tb > b->clock_tb && cs.mono > b->clock_ns &&
+	    cs.mono - b->clock_ns <= 0xffffffffULL &&
+	    cs.tb - b->clock_tb <= (~0ULL / 1000000)) {
+		uint64_t khz = (cs.tb - b->clock_tb) * 1000000;
+		do_div(khz, (unsigned long)(cs.mono - b->clock_ns));
+		if (khz)
+			b->clock_khz = khz;
+	}
+	b->clock_tb = cs.tb;
+	b->clock_ns = cs.mono;
+
+	add_event_entry(ESCAPE_CODE);
+	add_event_entry(RR_CLOCK_CORRELATION_CODE);
+	add_event_entry(cpu);
+	add_u64_entry(cs.tb);
+	add_u64_entry(cs.mono);
+	add_u64_entry(cs.real);
+
+	up(&buffer_sem);
+}
+
+/* Module load/unload records carry the module's core base and size,
+ * the time of the change and the name, NUL padded to whole entries.
+ * Kernel samples can then be resolved against the modules that were
+ * loaded when they were taken.
+ */
+static int
+module_load_notify(struct notifier_block *self, unsigned long val, void *data)
+{
+#ifdef CONFIG_MODULES
+	struct module *mod = data;
+	unsigned long code;
+	unsigned long base;
+	unsigned long size;
+	uint64_t timestamp;
+	size_t len;
+	size_t i;
+
+	if (val == MODULE_STATE_COMING)
+		code = RR_MODULE_LOAD_CODE;
+	else if (val == MODULE_STATE_GOING)
+		code = RR_MODULE_UNLOAD_CODE;
+	else
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	base = (unsigned long)mod->core_layout.base;
+	size = mod->core_layout.size;
+#else
+	base = (unsigned long)mod->module_core;
+	size = mod->core_size;
+#endif
+	len = strnlen(mod->name, MODULE_NAME_LEN);
+	timestamp = oprofile_get_tb();
+
+	down(&buffer_sem);
+	add_event_entry(ESCAPE_CODE);
+	add_event_entry(code);
+	add_event_entry(base);
+	add_event_entry(size);
+	add_u64_entry(oprofile_timestamp_ns ?
+		tb_to_ns(raw_smp_processor_id(), timestamp) : timestamp);
+	add_event_entry(len);
+	for (i = 0; i < len; i += sizeof(unsigned long)) {
+		unsigned long word = 0;
+
+		memcpy(&word, mod->name + i, min(len - i, sizeof(unsigned long)));
+		add_event_entry(word);
+	}
+	up(&buffer_sem);
+#endif
+	return 0;
+}
+
+static struct notifier_block module_load_nb = {
+	.notifier_call = module_load_notify,
+};
+#endif // RRPROFILE
+
 
 static void add_sample_entry(unsigned long offset, unsigned long event)
 {
@@ -549,38 +758,659 @@ typedef enum {
 	sb_sample_start,
 } sync_buffer_state;
 
+#ifdef RRPROFILE
+/* The state of one CPU's stream, as seen by the event buffer. */
+struct rr_sync_state {
+	int cpu;
+	int sizing;	/* output is only being counted, see drain_cpu() */
+	int in_kernel;
+	sync_buffer_state state;
+	unsigned long tgid;
+	unsigned long tid;
+	unsigned long adapt_value;
+	unsigned long period_scale;
+	unsigned long event_set;
+	unsigned long count_index;
+	uint64_t count_value;
+	uint64_t idle_begin;
+	uint64_t data_addr;
+	unsigned long data_latency;
+};
+
+static void rr_sync_state_reset(struct rr_sync_state *st, int cpu)
+{
+	st->cpu = cpu;
+	st->sizing = 0;
+	st->in_kernel = 1;
+	st->state = sb_buffer_start;
+	st->tgid = 0;
+	st->tid = 0;
+	st->adapt_value = 0;
+	st->period_scale = 0;
+	st->event_set = 0;
+	st->count_index = 0;
+	st->count_value = 0;
+	st->idle_begin = 0;
+	st->data_addr = 0;
+	st->data_latency = 0;
+}
+
+/* Translate a single CPU buffer entry into the event buffer. */
+static void rr_sync_entry(struct op_sample *s, struct rr_sync_state *st)
+{
+	if (is_code(s->eip)) {
+		if (s->event <= CPU_IS_KERNEL) {
+			/* kernel/userspace switch */
+			st->in_kernel = s->event;
+			if (st->state == sb_buffer_start)
+				st->state = sb_sample_start;
+			add_kernel_ctx_switch(s->event);
+		} else if (s->event == CPU_TRACE_BEGIN) {
+			st->state = sb_bt_start;
+			add_trace_begin();
+		} else if (s->event == RR_CPU_CTX_TGID) {
+			st->tgid = s->timestamp;
+		} else if (s->event == RR_CPU_CTX_TID) {
+			st->tid = s->timestamp;
+			add_user_ctx_switch_rr(st->tgid, st->tid);
+		} else if (s->event == RR_CPU_SAMPLING_START_TIMESTAMP) {
+			add_timestamp_entry(st->cpu, RR_CPU_SAMPLING_BEGIN_TIMESTAMP_CODE, s->timestamp);
+		} else if (s->event == RR_CPU_SAMPLING_STOP_TIMESTAMP) {
+			add_timestamp_entry(st->cpu, RR_CPU_SAMPLING_END_TIMESTAMP_CODE, s->timestamp);
+		} else if (s->event == RR_CPU_SAMPLE_START_TIMESTAMP) {
+			add_timestamp_entry(st->cpu, RR_SAMPLE_BEGIN_TIMESTAMP_CODE, s->timestamp);
+		} else if (s->event == RR_CPU_SAMPLE_STOP_TIMESTAMP) {
+			add_timestamp_entry(st->cpu, RR_SAMPLE_END_TIMESTAMP_CODE, s->timestamp);
+		} else if (s->event == RR_CPU_IDLE_BEGIN) {
+			st->idle_begin = s->timestamp;
+		} else if (s->event == RR_CPU_IDLE_END) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_IDLE_CODE);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, st->idle_begin) : st->idle_begin);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, s->timestamp) : s->timestamp);
+		} else if (s->event == RR_CPU_SAMPLE_PERIOD) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_SAMPLE_PERIOD_CODE);
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_ADAPT_VALUE) {
+			st->adapt_value = s->timestamp;
+		} else if (s->event == RR_CPU_ADAPT_TIMESTAMP) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_CPU_ADAPT_SAMPLING_INTERVAL_CODE);
+			add_event_entry(st->adapt_value);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, s->timestamp) : s->timestamp);
+		} else if (s->event == RR_CPU_SCALE_VALUE) {
+			st->period_scale = s->timestamp;
+		} else if (s->event == RR_CPU_SCALE_TIMESTAMP) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_CPU_PERIOD_SCALE_CODE);
+			add_event_entry(st->period_scale);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, s->timestamp) : s->timestamp);
+		} else if (s->event == RR_CPU_EVENT_SET_VALUE) {
+			st->event_set = s->timestamp;
+		} else if (s->event == RR_CPU_EVENT_SET_TIMESTAMP) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_EVENT_SET_CODE);
+			add_event_entry(st->event_set);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, s->timestamp) : s->timestamp);
+		} else if (s->event == RR_CPU_DATA_ADDR) {
+			st->data_addr = s->timestamp;
+		} else if (s->event == RR_CPU_DATA_LATENCY) {
+			st->data_latency = s->timestamp;
+		} else if (s->event == RR_CPU_DATA_SOURCE) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_SAMPLE_DATA_CODE);
+			add_u64_entry(st->data_addr);
+			add_event_entry(st->data_latency);
+			add_event_entry(s->timestamp);
+		} else if (s->event == IBS_FETCH_BEGIN ||
+			   s->event == IBS_OP_BEGIN) {
+			/* the registers follow back to back */
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(s->event == IBS_FETCH_BEGIN ?
+					IBS_FETCH_CODE : IBS_OP_CODE);
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_IBS_DATA) {
+			add_u64_entry(s->timestamp);
+		} else if (s->event == RR_CPU_BRANCH_COUNT) {
+			/* the branches follow back to back */
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_BRANCH_STACK_CODE);
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_BRANCH_FROM ||
+			   s->event == RR_CPU_BRANCH_TO) {
+			add_u64_entry(s->timestamp);
+		} else if (s->event == RR_CPU_BRANCH_FLAGS) {
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_GROUP_COUNT) {
+			/* the counters follow back to back */
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_SAMPLE_GROUP_CODE);
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_GROUP_COUNTER) {
+			add_event_entry(s->timestamp);
+		} else if (s->event == RR_CPU_GROUP_DELTA) {
+			add_u64_entry(s->timestamp);
+		} else if (s->event == RR_CPU_COUNT_INDEX) {
+			st->count_index = s->timestamp;
+		} else if (s->event == RR_CPU_COUNT_VALUE) {
+			st->count_value = s->timestamp;
+		} else if (s->event == RR_CPU_COUNT_TIMESTAMP) {
+			add_event_entry(ESCAPE_CODE);
+			add_event_entry(RR_COUNT_CODE);
+			add_event_entry(st->count_index);
+			add_u64_entry(st->count_value);
+			add_u64_entry(oprofile_timestamp_ns ?
+				tb_to_ns(st->cpu, s->timestamp) : s->timestamp);
+		}
+	} else {
+		if (st->state >= sb_bt_start &&
+		   !add_sample(NULL, s, st->in_kernel)) {
+			if (st->state == sb_bt_start) {
+				st->state = sb_bt_ignore;
+				if (!st->sizing)
+					atomic_inc(&oprofile_stats.bt_lost_no_mapping);
+			}
+		}
+	}
+}
+#endif // RRPROFILE
+
 /* Sync one of the CPU's buffers into the global event buffer.
  * Here we need to go through each batch of samples punctuated
  * by context switch notes, taking the task's mmap_sem and doing
  * lookup in task->mm->mmap to convert EIP into dcookie/offset
  * value.
  */
-void sync_buffer(int cpu)
-{
 #ifdef RRPROFILE
+static void __sync_buffer(int cpu)
+{
 	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[cpu];
+	struct rr_sync_state st;
+	unsigned int i;
+	unsigned long available;
+
+	rr_sync_state_reset(&st, cpu);
+
+	add_cpu_switch(cpu);
+
+	/* Remember, only we can modify tail_pos */
+
+	available = get_slots(cpu_buf);
+
+	for (i = 0; i < available; ++i) {
+		rr_sync_entry(&cpu_buf->buffer[cpu_buf->tail_pos], &st);
+		increment_tail(cpu_buf);
+	}
+
+	mark_done(cpu);
+}
+
+static void merge_cpu_buffers(int flush);
+static int drain_all_buffers(void);
+
+void sync_buffer(int cpu)
+{
+	down(&buffer_sem);
+	if (oprofile_merge_window)
+		merge_cpu_buffers(0);
+	else
+		__sync_buffer(cpu);
+	up(&buffer_sem);
+}
+
+/* Drain every online CPU buffer, e.g. once sampling has stopped. */
+void sync_all_buffers(void)
+{
+	int i;
+
+	down(&buffer_sem);
+	if (oprofile_merge_window) {
+		merge_cpu_buffers(1);
+	} else if (!drain_all_buffers()) {
+		for_each_online_cpu(i) {
+			__sync_buffer(i);
+		}
+	}
+	up(&buffer_sem);
+}
+
+/*
+ * Time-ordered merging of the CPU buffers.
+ *
+ * When a merge window is configured, the CPU buffers are not appended
+ * one after another. Instead each buffer is cut into groups, where a
+ * group starts at a sampling start/stop or sample start timestamp and
+ * runs up to the next group. Groups are keyed by their newest leading
+ * timestamp (the sample stop for a sample) and a k-way merge emits them
+ * in key order, switching CPU with CPU_SWITCH_CODE followed by that
+ * CPU's kernel/user and task context as needed.
+ *
+ * A group is only emitted once no CPU can still produce an older one:
+ * a CPU with pending data cannot go back past its newest group, and an
+ * empty CPU cannot go back past "now". Groups older than the window are
+ * emitted regardless so a stalled CPU cannot hold up the stream; anything
+ * arriving behind the emitted stream after that is counted in
+ * stats/merge_out_of_order.
+ */
+struct merge_cursor {
+	struct rr_sync_state sync;
+	unsigned long scan_pos;	/* first slot not yet scanned */
+	uint64_t latest_key;	/* newest timestamp seen by the scan */
+	uint64_t key;		/* key of the group at tail_pos */
+	unsigned long end;	/* slot just past the group at tail_pos */
+	unsigned long head;	/* head_pos snapshot for this merge */
+};
+
+#define MERGE_INTERVAL (HZ / 20)
+
+/* nr_cpu_ids of each, allocated by merge_reset() */
+static struct merge_cursor *merge_cursor;
+static int *merge_heap;
+static int merge_heap_len;
+static int merge_last_cpu;
+static uint64_t merge_last_key;
+static unsigned long merge_next_jiffies;
+
+static int merge_reset(void)
+{
+	int i;
+
+	merge_cursor = kcalloc(nr_cpu_ids, sizeof(*merge_cursor), GFP_KERNEL);
+	merge_heap = kcalloc(nr_cpu_ids, sizeof(*merge_heap), GFP_KERNEL);
+	if (!merge_cursor || !merge_heap) {
+		merge_exit();
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_cpu_ids; ++i) {
+		rr_sync_state_reset(&merge_cursor[i].sync, i);
+		merge_cursor[i].scan_pos = 0;
+		merge_cursor[i].latest_key = 0;
+	}
+	merge_heap_len = 0;
+	merge_last_cpu = -1;
+	merge_last_key = 0;
+	merge_next_jiffies = jiffies;
+	return 0;
+}
+
+static void merge_exit(void)
+{
+	kfree(merge_cursor);
+	kfree(merge_heap);
+	merge_cursor = NULL;
+	merge_heap = NULL;
+}
+
+static inline unsigned long next_slot(struct oprofile_cpu_buffer const *b,
+				      unsigned long pos)
+{
+	return (pos + 1 < b->buffer_size) ? pos + 1 : 0;
+}
+
+static inline int is_timestamp(struct op_sample const *s)
+{
+	return is_code(s->eip) &&
+		(s->event == RR_CPU_SAMPLING_START_TIMESTAMP ||
+		 s->event == RR_CPU_SAMPLING_STOP_TIMESTAMP ||
+		 s->event == RR_CPU_SAMPLE_START_TIMESTAMP ||
+		 s->event == RR_CPU_SAMPLE_STOP_TIMESTAMP);
+}
+
+static inline int is_group_start(struct op_sample const *s)
+{
+	if (is_code(s->eip) && s->event == RR_CPU_IDLE_BEGIN)
+		return 1;
+	return is_timestamp(s) && s->event != RR_CPU_SAMPLE_STOP_TIMESTAMP;
+}
+
+/* Find the key and the end of the group at tail_pos. Returns 0 if the
+ * group may still be growing, i.e. nothing follows it yet.
+ */
+static int merge_peek(struct oprofile_cpu_buffer const *b,
+		      struct merge_cursor *c)
+{
+	unsigned long head = c->head;
+	unsigned long pos = b->tail_pos;
+	struct op_sample const *s = &b->buffer[pos];
+
+	/* leftovers from before the merge was enabled sort first */
+	c->key = is_group_start(s) ? s->timestamp : merge_last_key;
+	pos = next_slot(b, pos);
+	if (is_timestamp(s) && s->event == RR_CPU_SAMPLE_START_TIMESTAMP &&
+	    pos != head &&
+	    is_timestamp(&b->buffer[pos]) &&
+	    b->buffer[pos].event == RR_CPU_SAMPLE_STOP_TIMESTAMP)
+		c->key = b->buffer[pos].timestamp;
+
+	while (pos != head && !is_group_start(&b->buffer[pos]))
+		pos = next_slot(b, pos);
+
+	c->end = pos;
+	return pos != head;
+}
+
+static inline int merge_before(int a, int b)
+{
+	return merge_cursor[a].key < merge_cursor[b].key;
+}
+
+static void merge_heap_down(int i)
+{
+	for (;;) {
+		int l = 2 * i + 1;
+		int r = l + 1;
+		int min = i;
+		int tmp;
+
+		if (l < merge_heap_len && merge_before(merge_heap[l], merge_heap[min]))
+			min = l;
+		if (r < merge_heap_len && merge_before(merge_heap[r], merge_heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		tmp = merge_heap[i];
+		merge_heap[i] = merge_heap[min];
+		merge_heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void merge_heap_push(int cpu)
+{
+	int i = merge_heap_len++;
+
+	merge_heap[i] = cpu;
+	while (i && merge_before(merge_heap[i], merge_heap[(i - 1) / 2])) {
+		int parent = (i - 1) / 2;
+		int tmp = merge_heap[i];
+
+		merge_heap[i] = merge_heap[parent];
+		merge_heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void merge_heap_pop(void)
+{
+	merge_heap[0] = merge_heap[--merge_heap_len];
+	merge_heap_down(0);
+}
+
+/* Can the group at tail_pos be emitted now? Fills in its key/end. */
+static int merge_ready(int cpu, uint64_t watermark, uint64_t horizon,
+		       int flush)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+	struct merge_cursor *c = &merge_cursor[cpu];
+	int closed;
+
+	if (b->tail_pos == c->head)
+		return 0;
+
+	closed = merge_peek(b, c);
+
+	if (flush)
+		return 1;
+
+	/* a whole group is written from one interrupt, so once it is
+	 * older than the window it cannot be growing any more */
+	return c->key <= watermark && (closed || c->key <= horizon);
+}
+
+static void merge_emit(int cpu)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+	struct merge_cursor *c = &merge_cursor[cpu];
+
+	if (cpu != merge_last_cpu) {
+		add_cpu_switch(cpu);
+		if (c->sync.state != sb_buffer_start)
+			add_kernel_ctx_switch(c->sync.in_kernel);
+		if (c->sync.tid)
+			add_user_ctx_switch_rr(c->sync.tgid, c->sync.tid);
+		merge_last_cpu = cpu;
+	}
+
+	if (c->key < merge_last_key)
+		atomic_inc(&oprofile_stats.merge_out_of_order);
+	else
+		merge_last_key = c->key;
+
+	while (b->tail_pos != c->end) {
+		rr_sync_entry(&b->buffer[b->tail_pos], &c->sync);
+		increment_tail(b);
+	}
+}
+
+static void merge_cpu_buffers(int flush)
+{
+	uint64_t now = oprofile_get_tb();
+	uint64_t window = oprofile_merge_window;
+	uint64_t watermark = now;
+	uint64_t horizon;
+	int i;
+
+	if (!flush) {
+		if (time_before(jiffies, merge_next_jiffies))
+			return;
+		merge_next_jiffies = jiffies + MERGE_INTERVAL;
+	}
+
+	window *= oprofile_get_tb_khz();
+	do_div(window, 1000);
+	horizon = now > window ? now - window : 0;
+
+	/* scan what arrived since the last merge */
+	for_each_online_cpu(i) {
+		struct oprofile_cpu_buffer *b = &cpu_buffer[i];
+		struct merge_cursor *c = &merge_cursor[i];
+
+		/* also resets the last_task/last_is_kernel notes, as
+		 * get_slots() does for the unmerged sync, but from the
+		 * cpu writing them, at its next sample */
+		b->reset_notes = 1;
+		c->head = b->head_pos;
+		rmb();
+
+		for (; c->scan_pos != c->head; c->scan_pos = next_slot(b, c->scan_pos)) {
+			struct op_sample const *s = &b->buffer[c->scan_pos];
+			if (is_timestamp(s))
+				c->latest_key = s->timestamp;
+		}
+
+		if (b->tail_pos != c->head && c->latest_key < watermark)
+			watermark = c->latest_key;
+	}
+
+	if (watermark < horizon)
+		watermark = horizon;
+
+	merge_heap_len = 0;
+	for_each_online_cpu(i) {
+		if (merge_ready(i, watermark, horizon, flush))
+			merge_heap_push(i);
+	}
+
+	while (merge_heap_len) {
+		int cpu = merge_heap[0];
+
+		merge_emit(cpu);
+
+		if (merge_ready(cpu, watermark, horizon, flush))
+			merge_heap_down(0);
+		else
+			merge_heap_pop();
+	}
+}
+
+/*
+ * Parallel drain of all CPU buffers, used when sampling stops or the
+ * rate is adapted. Each CPU translates its own buffer on a bound worker:
+ * a first pass only sizes the output, then the event buffer space is
+ * reserved in CPU order and a second pass fills it in. The caller holds
+ * buffer_sem across both passes, so the reader never sees a partly
+ * written range, and the time spent no longer grows with the number of
+ * CPUs.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+struct drain_work {
+	struct work_struct work;
+	unsigned long head;	/* head_pos snapshot for this drain */
+	struct event_sink sink;
+	int cpu;
+};
+
+static struct workqueue_struct *drain_wq;
+static DEFINE_PER_CPU(struct drain_work, drain_work);
+static atomic_t drain_pending;
+static struct completion drain_done;
+
+/* Translate [tail_pos, head) of one CPU buffer into the sink. */
+static void drain_cpu(struct drain_work *d)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[d->cpu];
+	struct rr_sync_state st;
+	unsigned long pos;
+
+	rr_sync_state_reset(&st, d->cpu);
+	st.sizing = !d->sink.buf;
+
+	/* the sink is per-CPU, nothing else may run here meanwhile */
+	get_cpu();
+	set_event_sink(&d->sink);
+
+	add_cpu_switch(d->cpu);
+	for (pos = b->tail_pos; pos != d->head; pos = next_slot(b, pos))
+		rr_sync_entry(&b->buffer[pos], &st);
+
+	set_event_sink(NULL);
+	put_cpu();
+
+	if (!st.sizing) {
+		b->tail_pos = d->head;
+		/* the next samples note their task and mode again, as
+		 * after get_slots(), this runs on the cpu writing them */
+		cpu_buffer_reset(b);
+	}
+}
+
+static void wq_drain_cpu(struct work_struct *work)
+{
+	drain_cpu(container_of(work, struct drain_work, work));
+
+	if (atomic_dec_and_test(&drain_pending))
+		complete(&drain_done);
+}
+
+/* Run drain_cpu() on every online CPU and wait for all of them. */
+static void drain_run(void)
+{
+	int i;
+
+	init_completion(&drain_done);
+	atomic_set(&drain_pending, 1);
+
+	for_each_online_cpu(i) {
+		atomic_inc(&drain_pending);
+		queue_work_on(i, drain_wq, &per_cpu(drain_work, i).work);
+	}
+
+	if (!atomic_dec_and_test(&drain_pending))
+		wait_for_completion(&drain_done);
+}
+
+static void drain_init(void)
+{
+	int i;
+
+	for_each_possible_cpu(i) {
+		INIT_WORK(&per_cpu(drain_work, i).work, wq_drain_cpu);
+		per_cpu(drain_work, i).cpu = i;
+	}
+
+	/* without it sync_all_buffers() drains the CPUs one by one */
+	drain_wq = create_workqueue("rrprofile_drain");
+}
+
+static void drain_exit(void)
+{
+	if (drain_wq)
+		destroy_workqueue(drain_wq);
+	drain_wq = NULL;
+}
+
+/* Returns 0 if the buffers must be drained serially instead. */
+static int drain_all_buffers(void)
+{
+	unsigned long total = 0;
+	unsigned long *out;
+	int i;
+
+	if (!drain_wq)
+		return 0;
+
+	get_online_cpus();
+
+	for_each_online_cpu(i) {
+		per_cpu(drain_work, i).head = cpu_buffer[i].head_pos;
+		per_cpu(drain_work, i).sink.buf = NULL;
+		per_cpu(drain_work, i).sink.len = 0;
+	}
+	rmb();
+
+	drain_run();
+
+	for_each_online_cpu(i) {
+		total += per_cpu(drain_work, i).sink.len;
+	}
+
+	/* let the serial path account for what does not fit */
+	out = reserve_event_entries(total);
+	if (!out) {
+		put_online_cpus();
+		return 0;
+	}
+
+	for_each_online_cpu(i) {
+		per_cpu(drain_work, i).sink.buf = out;
+		out += per_cpu(drain_work, i).sink.len;
+		per_cpu(drain_work, i).sink.len = 0;
+	}
+
+	drain_run();
+
+	for_each_online_cpu(i) {
+		mark_done(i);
+	}
+
+	put_online_cpus();
+	return 1;
+}
 #else
+static void drain_init(void) { }
+static void drain_exit(void) { }
+static int drain_all_buffers(void) { return 0; }
+#endif
+#else
+void sync_buffer(int cpu)
+{
 	struct oprofile_cpu_buffer *cpu_buf = &per_cpu(cpu_buffer, cpu);
-#endif // RRPROFILE
 	struct mm_struct *mm = NULL;
-#ifndef RRPROFILE
 	struct task_struct *new;
 	unsigned long cookie = 0;
-#endif // !RRPROFILE
 	int in_kernel = 1;
 	sync_buffer_state state = sb_buffer_start;
 	unsigned int i;
 	unsigned long available;
-#ifdef RRPROFILE
-	unsigned long tgid = 0;
-	unsigned long tid = 0;
-#endif // RRPROFILE
 
-#ifdef RRPROFILE
-	down(&buffer_sem);
-#else
 	mutex_lock(&buffer_mutex);
-#endif // RRPROFILE
  
 	add_cpu_switch(cpu);
 
@@ -589,11 +1419,7 @@ void sync_buffer(int cpu)
 	available = get_slots(cpu_buf);
 
 	for (i = 0; i < available; ++i) {
-#ifdef RRPROFILE
-		struct op_sample *s = &cpu_buf->buffer[cpu_buf->tail_pos];
-#else
 		struct op_sample *s = &cpu_buf->buffer[cpu_buf->tail_pos];
-#endif // RRPROFILE
  
 		if (is_code(s->eip)) {
 			if (s->event <= CPU_IS_KERNEL) {
@@ -605,51 +1431,7 @@ void sync_buffer(int cpu)
 			} else if (s->event == CPU_TRACE_BEGIN) {
 				state = sb_bt_start;
 				add_trace_begin();
-#ifdef RRPROFILE
-			} else if (s->event == RR_CPU_CTX_TGID) {
-				tgid = s->timestamp;
-			} else if (s->event == RR_CPU_CTX_TID) {
-				tid = s->timestamp;
-				add_user_ctx_switch_rr(tgid, tid);
-			} else if (s->event == RR_CPU_SAMPLING_START_TIMESTAMP) {
-				add_event_entry(ESCAPE_CODE);
-				add_event_entry(RR_CPU_SAMPLING_BEGIN_TIMESTAMP_CODE); 
-				if(sizeof(unsigned long) == 8) {
-					add_event_entry(s->timestamp);
-				} else {
-					add_event_entry(s->timestamp >> 32);
-					add_event_entry(s->timestamp);		
-				}
-			} else if (s->event == RR_CPU_SAMPLING_STOP_TIMESTAMP) {
-				add_event_entry(ESCAPE_CODE);
-				add_event_entry(RR_CPU_SAMPLING_END_TIMESTAMP_CODE);
-				if(sizeof(unsigned long) == 8) {
-					add_event_entry(s->timestamp);
-				} else {
-					add_event_entry(s->timestamp >> 32);
-					add_event_entry(s->timestamp);		
-				}
-			} else if (s->event == RR_CPU_SAMPLE_START_TIMESTAMP) {
-				add_event_entry(ESCAPE_CODE);
-				add_event_entry(RR_SAMPLE_BEGIN_TIMESTAMP_CODE); 
-				if(sizeof(unsigned long) == 8) {
-					add_event_entry(s->timestamp);
-				} else {
-					add_event_entry(s->timestamp >> 32);
-					add_event_entry(s->timestamp);		
-				}
-			} else if (s->event == RR_CPU_SAMPLE_STOP_TIMESTAMP) {
-				add_event_entry(ESCAPE_CODE);
-				add_event_entry(RR_SAMPLE_END_TIMESTAMP_CODE); 
-				if(sizeof(unsigned long) == 8) {
-					add_event_entry(s->timestamp);
-				} else {
-					add_event_entry(s->timestamp >> 32);
-					add_event_entry(s->timestamp);		
-				}
-#endif // RRPROFILE
 			} else {
-#ifndef RRPROFILE
 				struct mm_struct *oldmm = mm;
 
 				/* userspace context switch */
@@ -660,7 +1442,6 @@ void sync_buffer(int cpu)
 				if (mm != oldmm)
 					cookie = get_exec_dcookie(mm);
 				add_user_ctx_switch(new, cookie);
-#endif // !RRPROFILE
 			}
 		} else {
 			if (state >= sb_bt_start &&
@@ -674,18 +1455,13 @@ void sync_buffer(int cpu)
 
 		increment_tail(cpu_buf);
 	}
-#ifndef RRPROFILE
 	release_mm(mm);
-#endif // RRPROFILE
 
 	mark_done(cpu);
 
-#ifdef RRPROFILE
-	up(&buffer_sem);
-#else
 	mutex_unlock(&buffer_mutex);
-#endif // RRPROFILE
 }
+#endif // RRPROFILE
 
 /* The function can be used to add a buffer worth of data directly to
  * the kernel buffer. The buffer is assumed to be a circular buffer.
@@ -19,4 +19,12 @@ void sync_stop(void);
 /* sync the given CPU's buffer */
 void sync_buffer(int cpu);
 
+#ifdef RRPROFILE
+/* sync all online CPUs' buffers */
+void sync_all_buffers(void);
+
+/* record a clock correlation point for the given CPU */
+void sync_clock(int cpu);
+#endif // RRPROFILE
+
 #endif /* OPROFILE_BUFFER_SYNC_H */
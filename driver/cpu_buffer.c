@@ -26,6 +26,14 @@
 #endif // RRPROFILE
 #include <linux/vmalloc.h>
 #include <linux/errno.h>
+#ifdef RRPROFILE
+#include <linux/version.h>
+#include <linux/random.h>
+#include <asm/div64.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/math64.h>
+#endif
+#endif // RRPROFILE
 
 #include "event_buffer.h"
 #include "cpu_buffer.h"
@@ -46,6 +54,28 @@ static void wq_sync_buffer(void *);
 
 #define DEFAULT_TIMER_EXPIRE (HZ / 10)
 static int work_enabled;
+#ifdef RRPROFILE
+/* periods vary without jitter, see oprofile_record_sample_periods() */
+static int record_sample_periods;
+
+/* bounds of the periods of counters sampling at a frequency */
+#define FREQ_PERIOD_MIN		16
+#define FREQ_PERIOD_MAX		0x7fffffffUL
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+/* do_div() takes 32 bit divisors, shift a larger one down together
+ * with the dividend */
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	while (divisor >> 32) {
+		dividend >>= 1;
+		divisor >>= 1;
+	}
+	do_div(dividend, (u32)divisor);
+	return dividend;
+}
+#endif
+#endif // RRPROFILE
 
 void free_cpu_buffers(void)
 {
@@ -106,6 +136,23 @@ int alloc_cpu_buffers(void)
 		b->backtrace_aborted = 0;
 		b->sample_invalid_eip = 0;
 		b->cpu = i;
+#ifdef RRPROFILE
+		b->clock_tb = 0;
+		b->clock_ns = 0;
+		b->clock_khz = oprofile_get_tb_khz();
+		b->clock_jiffies = jiffies;
+		b->reset_notes = 0;
+		b->adapt_value = 1;
+		b->adapt_weight = 1;
+		b->max_mean = 0;
+		b->governor_scale = PERIOD_SCALE_ONE;
+		b->period_scale = PERIOD_SCALE_ONE;
+		b->overhead_tb = 0;
+		b->governor_overhead_tb = 0;
+		b->governor_lost = 0;
+		get_random_bytes(&b->jitter_state, sizeof(b->jitter_state));
+		b->jitter_state |= 1;
+#endif // RRPROFILE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 		INIT_DELAYED_WORK(&b->work, wq_sync_buffer);
 #else
@@ -163,6 +210,18 @@ void cpu_buffer_reset(struct oprofile_cpu_buffer *cpu_buf)
 	cpu_buf->last_task = NULL;
 }
 
+#ifdef RRPROFILE
+/* the reset a sync on another cpu asked for, on the cpu writing the
+ * notes so that it can't race with them */
+static inline void cpu_buffer_reset_notes(struct oprofile_cpu_buffer *cpu_buf)
+{
+	if (unlikely(cpu_buf->reset_notes)) {
+		cpu_buf->reset_notes = 0;
+		cpu_buffer_reset(cpu_buf);
+	}
+}
+#endif // RRPROFILE
+
 /* compute number of available slots in cpu_buffer queue */
 static unsigned long nr_available_slots(struct oprofile_cpu_buffer const *b)
 {
@@ -244,6 +303,9 @@ static int log_sample(struct oprofile_cpu_buffer *cpu_buf, unsigned long pc,
 	is_kernel = !!is_kernel;
 
 	task = current;
+#ifdef RRPROFILE
+	cpu_buffer_reset_notes(cpu_buf);
+#endif // RRPROFILE
 
 	/* notice a switch from user->kernel or vice versa */
 	if (cpu_buf->last_is_kernel != is_kernel) {
@@ -384,6 +446,275 @@ void oprofile_add_sample_stop(uint64_t timestamp)
 	
 	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_SAMPLE_STOP_TIMESTAMP, timestamp);
 }
+
+void oprofile_add_adapt(void)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	unsigned long value, scale;
+
+	/* pairs with the smp_wmb() in oprofile_adapt(), a reload with the
+	 * new interval sees its value */
+	smp_rmb();
+	value = oprofile_adapt_value * cpu_buf->adapt_weight;
+	scale = cpu_buf->governor_scale;
+
+	if (cpu_buf->adapt_value != value) {
+		/* no room, note it at the next reload instead */
+		if (nr_available_slots(cpu_buf) < 2)
+			return;
+
+		cpu_buf->adapt_value = value;
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_ADAPT_VALUE, value);
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_ADAPT_TIMESTAMP, oprofile_get_tb());
+	}
+
+	if (cpu_buf->period_scale != scale) {
+		if (nr_available_slots(cpu_buf) < 2)
+			return;
+
+		cpu_buf->period_scale = scale;
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_SCALE_VALUE, scale);
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_SCALE_TIMESTAMP, oprofile_get_tb());
+	}
+}
+
+void oprofile_add_overhead(uint64_t begin)
+{
+	cpu_buffer[smp_processor_id()].overhead_tb += oprofile_get_tb() - begin;
+}
+
+/* Move a quarter of the way to the period that would have taken
+ * 1/freq seconds. That damps the noise of single intervals and still
+ * follows a change of the event rate within a few samples.
+ */
+unsigned long oprofile_freq_period(unsigned long period, uint64_t elapsed,
+				   unsigned long freq)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	uint64_t target;
+
+	if (!elapsed || !freq || !period)
+		return period;
+
+	/* timebase ticks per sample */
+	target = (uint64_t)cpu_buf->clock_khz * 1000;
+	do_div(target, freq);
+	/* period * ticks per sample / elapsed, dividing first where the
+	 * product would wrap */
+	if (target <= div64_u64(~0ULL, period)) {
+		target = div64_u64(target * period, elapsed);
+	} else {
+		target = div64_u64(target, elapsed);
+		target = target > div64_u64(~0ULL, period) ?
+			~0ULL : target * period;
+	}
+
+	if (target > period)
+		target = period + (target - period) / 4;
+	else
+		target = period - (period - target) / 4;
+
+	if (target < FREQ_PERIOD_MIN)
+		return FREQ_PERIOD_MIN;
+	if (target > FREQ_PERIOD_MAX)
+		return FREQ_PERIOD_MAX;
+	return (unsigned long)target;
+}
+
+/* This is called from NMI context, so draw from a cheap per-CPU
+ * xorshift generator rather than the kernel's entropy pool.
+ */
+unsigned long oprofile_jitter_period(unsigned long mean)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	unsigned long jitter = oprofile_sample_jitter;
+	unsigned long weight = cpu_buf->adapt_weight;
+	unsigned long max = oprofile_ops.max_period;
+	unsigned long span;
+	u64 scaled;
+	u32 x;
+
+	/* the governor scale and the weight of this cpu, both stay at one
+	 * without a max_period */
+	if (max) {
+		scaled = (u64)min(mean, max) * cpu_buf->period_scale;
+		scaled >>= PERIOD_SCALE_SHIFT;
+		mean = scaled > max ? max : (unsigned long)scaled;
+		if (mean > cpu_buf->max_mean)
+			cpu_buf->max_mean = mean;
+		mean = mean > max / weight ? max : mean * weight;
+	}
+	if (!mean)
+		mean = 1;
+
+	if (!jitter)
+		return mean;
+	if (jitter > SAMPLE_JITTER_MAX)
+		jitter = SAMPLE_JITTER_MAX;
+
+	span = mean / 100 * jitter + mean % 100 * jitter / 100;
+	/* the draw stays within [mean - span, mean + span], which has to
+	 * end at max_period and fit the 32 bit draw. mean - span stays
+	 * positive as jitter is below 100%. */
+	if (max && span > max - mean)
+		span = max - mean;
+	if (span > 0x7fffffffUL)
+		span = 0x7fffffffUL;
+	if (!span)
+		return mean;
+
+	x = cpu_buf->jitter_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	cpu_buf->jitter_state = x;
+
+	/* scaled rather than taken modulo the range, which would favour
+	 * the low end */
+	return mean - span + (unsigned long)(((u64)x * (2 * span + 1)) >> 32);
+}
+
+void oprofile_add_sample_period(unsigned long period)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (!oprofile_sample_jitter && !record_sample_periods)
+		return;
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_SAMPLE_PERIOD, period);
+}
+
+void oprofile_add_sample_data(uint64_t addr, unsigned long latency,
+			      unsigned long source)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (nr_available_slots(cpu_buf) < 3) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_DATA_ADDR, addr);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_DATA_LATENCY, latency);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_DATA_SOURCE, source);
+}
+
+void oprofile_add_branch_stack(struct op_branch const *branches, int nr)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	int i;
+
+	if (nr_available_slots(cpu_buf) < 1 + 3 * nr) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_BRANCH_COUNT, nr);
+	for (i = 0; i < nr; ++i) {
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_BRANCH_FROM, branches[i].from);
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_BRANCH_TO, branches[i].to);
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_BRANCH_FLAGS, branches[i].flags);
+	}
+}
+
+void oprofile_add_ibs_data(int code, uint64_t const *data, int nr)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	int i;
+
+	if (nr_available_slots(cpu_buf) < 1 + nr) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE,
+		   code == IBS_FETCH_CODE ? IBS_FETCH_BEGIN : IBS_OP_BEGIN, nr);
+	for (i = 0; i < nr; ++i)
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_IBS_DATA, data[i]);
+}
+
+void oprofile_add_sample_group(struct op_group_value const *values, int nr)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+	int i;
+
+	if (nr_available_slots(cpu_buf) < 1 + 2 * nr) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_GROUP_COUNT, nr);
+	for (i = 0; i < nr; ++i) {
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_GROUP_COUNTER, values[i].counter);
+		add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_GROUP_DELTA, values[i].delta);
+	}
+}
+
+void oprofile_record_sample_periods(int on)
+{
+	record_sample_periods = on;
+}
+
+void oprofile_add_event_set(unsigned long set)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (nr_available_slots(cpu_buf) < 2) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_EVENT_SET_VALUE, set);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_EVENT_SET_TIMESTAMP, oprofile_get_tb());
+}
+
+void oprofile_add_count(unsigned long counter, uint64_t value)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (nr_available_slots(cpu_buf) < 3) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_COUNT_INDEX, counter);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_COUNT_VALUE, value);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_COUNT_TIMESTAMP, oprofile_get_tb());
+}
+
+void oprofile_read_counts(struct task_struct *task)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (!oprofile_ops.read_counts)
+		return;
+
+	cpu_buffer_reset_notes(cpu_buf);
+	/* the counts belong to the task that ran since the last read */
+	if (task && cpu_buf->last_task != task) {
+		if (nr_available_slots(cpu_buf) < 2) {
+			cpu_buf->sample_lost_overflow++;
+			return;
+		}
+		cpu_buf->last_task = task;
+		add_code_ctx_rr(cpu_buf, task->tgid, task->pid);
+	}
+
+	oprofile_ops.read_counts();
+}
+
+void oprofile_add_idle(uint64_t begin, uint64_t end)
+{
+	struct oprofile_cpu_buffer *cpu_buf = &cpu_buffer[smp_processor_id()];
+
+	if (nr_available_slots(cpu_buf) < 2) {
+		cpu_buf->sample_lost_overflow++;
+		return;
+	}
+
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_IDLE_BEGIN, begin);
+	add_sample(cpu_buf, ESCAPE_CODE, RR_CPU_IDLE_END, end);
+}
 #endif // RRPROFILE
 
 /*
@@ -403,6 +734,10 @@ static void wq_sync_buffer(void *data)
 {
 	struct oprofile_cpu_buffer *b = data;
 #endif
+#ifdef RRPROFILE
+	uint64_t begin;
+#endif // RRPROFILE
+
 	if (b->cpu != smp_processor_id()) {
 		printk(KERN_DEBUG "WQ on CPU%d, prefer CPU%d\n",
 		       smp_processor_id(), b->cpu);
@@ -412,7 +747,32 @@ static void wq_sync_buffer(void *data)
 			return;
 		}
 	}
+#ifdef RRPROFILE
+	if (oprofile_started && b->cpu == smp_processor_id()) {
+		unsigned long flags;
+
+		local_irq_save(flags);
+		oprofile_read_counts(oprofile_count_per_task ? current : NULL);
+		local_irq_restore(flags);
+	}
+
+	/* syncing is sampling overhead too */
+	begin = oprofile_get_tb();
+	sync_buffer(b->cpu);
+	if (b->cpu == smp_processor_id())
+		b->overhead_tb += oprofile_get_tb() - begin;
+#else
 	sync_buffer(b->cpu);
+#endif // RRPROFILE
+
+#ifdef RRPROFILE
+	if (oprofile_started && oprofile_clock_sync_interval &&
+	    time_after_eq(jiffies, b->clock_jiffies)) {
+		sync_clock(b->cpu);
+		b->clock_jiffies = jiffies +
+			msecs_to_jiffies(oprofile_clock_sync_interval);
+	}
+#endif // RRPROFILE
 
 	/* don't re-add the work if we're shutting down */
 	if (work_enabled)
@@ -49,6 +49,34 @@ struct oprofile_cpu_buffer {
 	unsigned long backtrace_aborted;
 	unsigned long sample_invalid_eip;
 	int cpu;
+#ifdef RRPROFILE
+	/* latest clock correlation point, see sync_clock() */
+	uint64_t clock_tb;
+	uint64_t clock_ns;
+	unsigned long clock_khz;
+	unsigned long clock_jiffies;
+	/* set by a sync on another cpu, this CPU then resets last_task
+	 * and last_is_kernel itself, see cpu_buffer_reset() */
+	int reset_notes;
+	/* adapt value this CPU last reloaded with */
+	unsigned long adapt_value;
+	/* this CPU's own periods multiplier, see oprofile_adapt_cpu() */
+	unsigned long adapt_weight;
+	/* largest scaled mean period loaded before the weight, for its
+	 * limit */
+	unsigned long max_mean;
+	/* governor period scale set for this CPU, and the one it last
+	 * reloaded with */
+	unsigned long governor_scale;
+	unsigned long period_scale;
+	/* tb ticks spent taking samples and syncing, see oprofile_governor.c */
+	uint64_t overhead_tb;
+	/* overhead_tb and sample_lost_overflow at the last governor tick */
+	uint64_t governor_overhead_tb;
+	unsigned long governor_lost;
+	/* xorshift state for oprofile_jitter_period() */
+	u32 jitter_state;
+#endif // RRPROFILE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 	struct delayed_work work;
 #else
@@ -64,6 +92,11 @@ DECLARE_PER_CPU(struct oprofile_cpu_buffer, cpu_buffer);
 
 void cpu_buffer_reset(struct oprofile_cpu_buffer *cpu_buf);
 
+#ifdef RRPROFILE
+/* publish this cpu's counting mode totals, for @task if not NULL */
+void oprofile_read_counts(struct task_struct *task);
+#endif // RRPROFILE
+
 /* transient events for the CPU buffer -> event buffer */
 #define CPU_IS_KERNEL 1
 #define CPU_TRACE_BEGIN 2
@@ -76,6 +109,29 @@ void cpu_buffer_reset(struct oprofile_cpu_buffer *cpu_buf);
 #define RR_CPU_SAMPLING_STOP_TIMESTAMP		103
 #define RR_CPU_SAMPLE_START_TIMESTAMP		104
 #define RR_CPU_SAMPLE_STOP_TIMESTAMP		105
+#define RR_CPU_ADAPT_VALUE					106
+#define RR_CPU_ADAPT_TIMESTAMP				107
+#define RR_CPU_SAMPLE_PERIOD				108
+#define RR_CPU_IDLE_BEGIN					109
+#define RR_CPU_IDLE_END						110
+#define RR_CPU_EVENT_SET_VALUE				111
+#define RR_CPU_EVENT_SET_TIMESTAMP			112
+#define RR_CPU_COUNT_INDEX					113
+#define RR_CPU_COUNT_VALUE					114
+#define RR_CPU_COUNT_TIMESTAMP				115
+#define RR_CPU_SCALE_VALUE					116
+#define RR_CPU_SCALE_TIMESTAMP				117
+#define RR_CPU_DATA_ADDR					118
+#define RR_CPU_DATA_LATENCY					119
+#define RR_CPU_DATA_SOURCE					120
+#define RR_CPU_BRANCH_COUNT					121
+#define RR_CPU_BRANCH_FROM					122
+#define RR_CPU_BRANCH_TO					123
+#define RR_CPU_BRANCH_FLAGS					124
+#define RR_CPU_IBS_DATA						125
+#define RR_CPU_GROUP_COUNT					126
+#define RR_CPU_GROUP_COUNTER				127
+#define RR_CPU_GROUP_DELTA					128
 #endif // RRPROFILE
 
 #endif /* OPROFILE_CPU_BUFFER_H */
@@ -22,6 +22,7 @@
 #include <linux/capability.h>
 #include <linux/dcookies.h>
 #include <linux/fs.h>
+#include <linux/percpu.h>
 #include <asm/uaccess.h>
 
 #include "oprof.h"
@@ -47,6 +48,10 @@ static unsigned long buffer_watershed;
 static size_t buffer_pos;
 /* atomic_t because wait_event checks it outside of buffer_mutex / buffer_sem */
 static atomic_t buffer_ready = ATOMIC_INIT(0);
+#ifdef RRPROFILE
+/* per-CPU redirection of add_event_entry(), see set_event_sink() */
+static DEFINE_PER_CPU(struct event_sink *, event_sink);
+#endif // RRPROFILE
 
 /* Add an entry to the event buffer. When we
  * get near to the end we wake up the process
@@ -54,6 +59,16 @@ static atomic_t buffer_ready = ATOMIC_INIT(0);
  */
 void add_event_entry(unsigned long value)
 {
+#ifdef RRPROFILE
+	struct event_sink *sink = per_cpu(event_sink, raw_smp_processor_id());
+
+	if (unlikely(sink)) {
+		if (sink->buf)
+			sink->buf[sink->len] = value;
+		sink->len++;
+		return;
+	}
+#endif // RRPROFILE
 	if (buffer_pos == buffer_size) {
 		atomic_inc(&oprofile_stats.event_lost_overflow);
 		return;
@@ -66,6 +81,40 @@ void add_event_entry(unsigned long value)
 	}
 }
 
+#ifdef RRPROFILE
+/* Redirect add_event_entry() on this CPU into @sink, or back into the
+ * event buffer if @sink is NULL. The caller must keep preemption
+ * disabled while a sink is set, so that nothing else on this CPU can
+ * add entries in the meantime.
+ */
+void set_event_sink(struct event_sink *sink)
+{
+	per_cpu(event_sink, smp_processor_id()) = sink;
+}
+
+/* Reserve @count consecutive entries at the end of the event buffer, to
+ * be filled in by the caller while it still holds buffer_sem. Returns
+ * NULL if they do not fit.
+ */
+unsigned long *reserve_event_entries(unsigned long count)
+{
+	unsigned long *start;
+	size_t watershed = buffer_size - buffer_watershed;
+
+	if (count > buffer_size - buffer_pos)
+		return NULL;
+
+	start = &event_buffer[buffer_pos];
+	if (buffer_pos < watershed && buffer_pos + count >= watershed) {
+		atomic_set(&buffer_ready, 1);
+		wake_up(&buffer_wait);
+	}
+	buffer_pos += count;
+
+	return start;
+}
+#endif // RRPROFILE
+
 
 /* Wake up the waiting process if any. This happens
  * on "echo 0 >/dev/oprofile/enable" so the daemon
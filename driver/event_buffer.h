@@ -35,6 +35,20 @@ void free_event_buffer(void);
  */
 void add_event_entry(unsigned long data);
 
+#ifdef RRPROFILE
+/* Output of add_event_entry() while redirected. With a NULL buf the
+ * entries are only counted.
+ */
+struct event_sink {
+	unsigned long *buf;
+	unsigned long len;
+};
+
+void set_event_sink(struct event_sink *sink);
+
+unsigned long *reserve_event_entries(unsigned long count);
+#endif // RRPROFILE
+
 /* wake up the process sleeping on the event file */
 void wake_up_buffer_waiter(void);
 
@@ -0,0 +1,204 @@
+/**
+ * @file kernel_syms.c
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * A binary snapshot of the kernel and module symbols, taken when
+ * profiling starts and exported as the "kallsyms" file, so that kernel
+ * samples can be resolved by a binary search over a table that does not
+ * change under the reader, instead of parsing /proc/kallsyms and
+ * /proc/modules after the fact.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kallsyms.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/fs.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/semaphore.h>
+#else
+#include <asm/semaphore.h>
+#endif
+
+#include "kernel_syms.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+static DEFINE_SEMAPHORE(syms_sem);
+#else
+static DECLARE_MUTEX(syms_sem);
+#endif
+static void *syms_blob;
+static size_t syms_blob_size;
+
+#if defined(CONFIG_KALLSYMS) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+
+struct syms_walk {
+	struct kernel_sym *syms;	/* NULL while sizing */
+	char *strtab;
+	u32 count;
+	u32 max_count;
+	u32 strtab_size;
+	u32 max_strtab_size;
+	struct module *last_mod;
+	u32 last_mod_name;
+};
+
+static u32 syms_add_string(struct syms_walk *w, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	u32 off = w->strtab_size;
+
+	if (w->strtab) {
+		if (off + len > w->max_strtab_size)
+			return 0;
+		memcpy(w->strtab + off, str, len);
+	}
+	w->strtab_size += len;
+	return off;
+}
+
+static int syms_add(void *data, const char *name, struct module *mod,
+		    unsigned long addr)
+{
+	struct syms_walk *w = data;
+	struct kernel_sym *sym;
+
+	if (w->syms && w->count == w->max_count)
+		return 1;
+
+	/* symbols come grouped by module, only store each name once */
+	if (mod != w->last_mod) {
+		w->last_mod = mod;
+		w->last_mod_name = mod ? syms_add_string(w, mod->name) : 0;
+	}
+
+	if (!w->syms) {
+		syms_add_string(w, name);
+		w->count++;
+		return 0;
+	}
+
+	sym = &w->syms[w->count++];
+	sym->addr = addr;
+	sym->name = syms_add_string(w, name);
+	sym->module = w->last_mod_name;
+	return 0;
+}
+
+static int syms_cmp(const void *a, const void *b)
+{
+	const struct kernel_sym *l = a;
+	const struct kernel_sym *r = b;
+
+	if (l->addr < r->addr)
+		return -1;
+	return l->addr > r->addr;
+}
+
+static void syms_walk(struct syms_walk *w)
+{
+	w->count = 0;
+	w->strtab_size = 0;
+	w->last_mod = NULL;
+	w->last_mod_name = 0;
+	/* offset 0 is the empty string */
+	syms_add_string(w, "");
+
+	kallsyms_on_each_symbol(syms_add, w);
+}
+
+int kernel_syms_snapshot(void)
+{
+	struct kernel_syms_header *hdr;
+	struct syms_walk w;
+	size_t size;
+	void *blob;
+
+	memset(&w, 0, sizeof(w));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	mutex_lock(&module_mutex);
+#endif
+	syms_walk(&w);
+
+	/* leave room for modules loading between the two walks */
+	w.max_count = w.count + w.count / 8;
+	w.max_strtab_size = w.strtab_size + w.strtab_size / 8;
+	size = sizeof(*hdr) + w.max_count * sizeof(struct kernel_sym) +
+		w.max_strtab_size;
+
+	blob = vmalloc(size);
+	if (!blob) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+		mutex_unlock(&module_mutex);
+#endif
+		return -ENOMEM;
+	}
+
+	hdr = blob;
+	w.syms = (struct kernel_sym *)(hdr + 1);
+	w.strtab = (char *)(w.syms + w.max_count);
+	syms_walk(&w);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	mutex_unlock(&module_mutex);
+#endif
+
+	sort(w.syms, w.count, sizeof(struct kernel_sym), syms_cmp, NULL);
+
+	/* close the gap between the symbols and the string table */
+	memmove(w.syms + w.count, w.strtab, w.strtab_size);
+
+	hdr->magic = KERNEL_SYMS_MAGIC;
+	hdr->version = KERNEL_SYMS_VERSION;
+	hdr->count = w.count;
+	hdr->strtab_size = w.strtab_size;
+
+	down(&syms_sem);
+	vfree(syms_blob);
+	syms_blob = blob;
+	syms_blob_size = sizeof(*hdr) + w.count * sizeof(struct kernel_sym) +
+		w.strtab_size;
+	up(&syms_sem);
+
+	return 0;
+}
+
+#else
+
+int kernel_syms_snapshot(void)
+{
+	return -ENOSYS;
+}
+
+#endif
+
+void kernel_syms_free(void)
+{
+	down(&syms_sem);
+	vfree(syms_blob);
+	syms_blob = NULL;
+	syms_blob_size = 0;
+	up(&syms_sem);
+}
+
+static ssize_t kernel_syms_read(struct file *file, char __user *buf,
+				size_t count, loff_t *offset)
+{
+	ssize_t ret;
+
+	down(&syms_sem);
+	ret = simple_read_from_buffer(buf, count, offset, syms_blob,
+				      syms_blob_size);
+	up(&syms_sem);
+
+	return ret;
+}
+
+const struct file_operations kernel_syms_fops = {
+	.read		= kernel_syms_read,
+};
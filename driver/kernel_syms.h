@@ -0,0 +1,41 @@
+/**
+ * @file kernel_syms.h
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ */
+
+#ifndef OPROFILE_KERNEL_SYMS_H
+#define OPROFILE_KERNEL_SYMS_H
+
+#include <linux/types.h>
+
+#define KERNEL_SYMS_MAGIC	0x534b5252	/* "RRKS" */
+#define KERNEL_SYMS_VERSION	1
+
+/* The "kallsyms" file holds a header, the symbols sorted by address
+ * and a string table. name and module are offsets into the string
+ * table; offset 0 is the empty string, used as module of vmlinux.
+ */
+struct kernel_syms_header {
+	u32 magic;
+	u32 version;
+	u32 count;
+	u32 strtab_size;
+};
+
+struct kernel_sym {
+	u64 addr;
+	u32 name;
+	u32 module;
+};
+
+/* take a new snapshot of the kernel and module symbols */
+int kernel_syms_snapshot(void);
+
+/* release the current snapshot */
+void kernel_syms_free(void);
+
+extern const struct file_operations kernel_syms_fops;
+
+#endif /* OPROFILE_KERNEL_SYMS_H */
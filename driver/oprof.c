@@ -23,6 +23,13 @@
 #else
 #include <asm/semaphore.h>
 #endif
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0) && defined(CONFIG_TRACEPOINTS)
+#include <linux/tracepoint.h>
+#define HAVE_SCHED_SWITCH_PROBE
+#endif
 #else
 #include <linux/workqueue.h>
 #include <linux/time.h>
@@ -34,33 +41,37 @@
 #include "cpu_buffer.h"
 #include "buffer_sync.h"
 #include "oprofile_stats.h"
+#ifdef RRPROFILE
+#include "kernel_syms.h"
+#endif // RRPROFILE
 
 #ifdef RRPROFILE
 int rrprofile_debug = 0;
-
-// not supported (yet)
-#undef CONFIG_OPROFILE_EVENT_MULTIPLEX
-
 #endif // RRPROFILE
 
 struct oprofile_operations oprofile_ops;
 #ifdef RRPROFILE
 struct oprofile_operations arch_ops;
 struct oprofile_operations timer_ops;
+struct oprofile_operations perf_ops;
+unsigned long oprofile_event_backend = EVENT_BACKEND_NATIVE;
 #endif // RRPROFILE
 unsigned long oprofile_started;
 unsigned long oprofile_backtrace_depth;
 #ifdef RRPROFILE
 unsigned long oprofile_timer_count = 1; // jiffy count between samples
+unsigned long oprofile_timer_period = 0; // nsecs between samples, overrides timer_count
 #endif // RRPROFILE
 static unsigned long is_setup;
 #ifdef RRPROFILE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-static DEFINE_SEMAPHORE(start_sem);
+DEFINE_SEMAPHORE(start_sem);
 #else
-static DECLARE_MUTEX(start_sem);
+DECLARE_MUTEX(start_sem);
 #endif
 unsigned long oprofile_adapt_value = 1;
+pid_t oprofile_task_filter[TASK_FILTER_MAX];
+int oprofile_task_filter_nr;
 #else
 static DEFINE_MUTEX(start_mutex);
 #endif // RRPROFILE
@@ -85,6 +96,9 @@ int oprofile_setup(void)
 
 	if ((err = alloc_cpu_buffers()))
 		goto out;
+#ifdef RRPROFILE
+	oprofile_record_sample_periods(0);
+#endif // RRPROFILE
 
 	if ((err = alloc_event_buffer()))
 		goto out1;
@@ -174,7 +188,11 @@ int oprofile_set_timeout(unsigned long val_msec)
 	int err = 0;
 	unsigned long time_slice;
 
+#ifdef RRPROFILE
+	down(&start_sem);
+#else
 	mutex_lock(&start_mutex);
+#endif // RRPROFILE
 
 	if (oprofile_started) {
 		err = -EBUSY;
@@ -195,7 +213,11 @@ int oprofile_set_timeout(unsigned long val_msec)
 	oprofile_time_slice = time_slice;
 
 out:
+#ifdef RRPROFILE
+	up(&start_sem);
+#else
 	mutex_unlock(&start_mutex);
+#endif // RRPROFILE
 	return err;
 
 }
@@ -207,10 +229,162 @@ static inline void stop_switch_worker(void) { }
 
 #endif
 
+#ifdef RRPROFILE
+int oprofile_set_task_filter(pid_t const *pids, int nr)
+{
+	int err = 0;
+
+	down(&start_sem);
+	if (oprofile_started) {
+		err = -EBUSY;
+		goto out;
+	}
+	memcpy(oprofile_task_filter, pids, nr * sizeof(pids[0]));
+	oprofile_task_filter_nr = nr;
+out:
+	up(&start_sem);
+	return err;
+}
+
+/*
+ * Counting mode. Counters enabled with a count of 0 run freely, their
+ * totals are read at the sync period (see wq_sync_buffer()), on stop,
+ * and with count_per_task on every context switch, so they add up per
+ * task. The sched_switch tracepoint is not exported to modules, so it
+ * is looked up by name. The arch gets to see the switches as well.
+ *
+ * With a task_filter, the switches also stop sampling on a cpu while
+ * none of the tasks in it runs there, so the overhead follows the time
+ * they run, and with count_per_task the counts are theirs alone.
+ */
+#ifdef HAVE_SCHED_SWITCH_PROBE
+static struct tracepoint *sched_switch_tp;
+static int count_switch_on;
+static int count_switch_reads;
+static int task_scope_on;
+/* whether sampling runs on each cpu */
+static DEFINE_PER_CPU(int, task_scope_in);
+
+static int task_followed(struct task_struct *task)
+{
+	int i;
+
+	for (i = 0; i < oprofile_task_filter_nr; ++i) {
+		if (task->pid == oprofile_task_filter[i] ||
+		    task->tgid == oprofile_task_filter[i])
+			return 1;
+	}
+	return 0;
+}
+
+static void task_scope_switch(struct task_struct *next)
+{
+	int cpu = smp_processor_id();
+	int in = task_followed(next);
+
+	if (in == per_cpu(task_scope_in, cpu))
+		return;
+	per_cpu(task_scope_in, cpu) = in;
+	oprofile_ops.task_scope(in);
+}
+
+static void task_scope_cpu(void *dummy)
+{
+	task_scope_switch(current);
+}
+
+static void find_sched_switch(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sched_switch"))
+		sched_switch_tp = tp;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+static void count_sched_switch(void *data, bool preempt,
+			       struct task_struct *prev, struct task_struct *next)
+#else
+static void count_sched_switch(void *data, struct task_struct *prev,
+			       struct task_struct *next)
+#endif
+{
+	if (count_switch_reads)
+		oprofile_read_counts(prev);
+	if (oprofile_ops.sched_switch)
+		oprofile_ops.sched_switch();
+	if (task_scope_on)
+		task_scope_switch(next);
+}
+
+static void start_count_switch(void)
+{
+	int cpu;
+
+	count_switch_reads = oprofile_count_per_task && oprofile_ops.read_counts;
+	task_scope_on = oprofile_task_filter_nr && oprofile_ops.task_scope;
+	if (oprofile_task_filter_nr && !oprofile_ops.task_scope)
+		printk(KERN_INFO "rrprofile: task_filter not supported in this mode.\n");
+	if (!count_switch_reads && !oprofile_ops.sched_switch && !task_scope_on)
+		return;
+
+	/* start() left sampling running on every cpu */
+	for_each_possible_cpu(cpu)
+		per_cpu(task_scope_in, cpu) = 1;
+
+	if (!sched_switch_tp)
+		for_each_kernel_tracepoint(find_sched_switch, NULL);
+	if (!sched_switch_tp ||
+	    tracepoint_probe_register(sched_switch_tp, count_sched_switch, NULL)) {
+		printk(KERN_INFO "rrprofile: sched_switch not available.\n");
+		oprofile_count_per_task = 0;
+		task_scope_on = 0;
+		return;
+	}
+	count_switch_on = 1;
+
+	if (task_scope_on)
+		on_each_cpu(task_scope_cpu, NULL, 1);
+}
+
+static void stop_count_switch(void)
+{
+	if (!count_switch_on)
+		return;
+
+	count_switch_on = 0;
+	tracepoint_probe_unregister(sched_switch_tp, count_sched_switch, NULL);
+	tracepoint_synchronize_unregister();
+}
+#else
+static void start_count_switch(void)
+{
+	if (oprofile_count_per_task && oprofile_ops.read_counts) {
+		printk(KERN_INFO "rrprofile: per task counts not supported on this kernel.\n");
+		oprofile_count_per_task = 0;
+	}
+	if (oprofile_task_filter_nr)
+		printk(KERN_INFO "rrprofile: task_filter not supported on this kernel.\n");
+}
+
+static void stop_count_switch(void) { }
+#endif // HAVE_SCHED_SWITCH_PROBE
+
+static void read_counts_cpu(void *dummy)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	oprofile_read_counts(oprofile_count_per_task ? current : NULL);
+	local_irq_restore(flags);
+}
+#endif // RRPROFILE
+
 /* Actually start profiling (echo 1>/dev/oprofile/enable) */
 int oprofile_start(void)
 {
 	int err = -EINVAL;
+ #ifdef RRPROFILE
+	int i;
+ #endif // RRPROFILE
 
  #ifdef RRPROFILE
 	down(&start_sem);
@@ -229,15 +403,39 @@ int oprofile_start(void)
 	oprofile_reset_stats();
  #ifdef RRPROFILE
 	oprofile_adapt_value = 1;
+	down(&buffer_sem);
 	add_event_entry(ESCAPE_CODE);
 	add_event_entry(RR_ADAPT_SAMPLING_INTERVAL_CODE);
 	add_event_entry(oprofile_adapt_value);
+	add_event_entry(ESCAPE_CODE);
+	add_event_entry(RR_TIMESTAMP_FORMAT_CODE);
+	add_event_entry(oprofile_timestamp_ns);
+	up(&buffer_sem);
+
+	/* anchor every CPU's timebase before the first sample */
+	for_each_online_cpu(i) {
+		cpu_buffer[i].adapt_value = oprofile_adapt_value;
+		cpu_buffer[i].adapt_weight = 1;
+		cpu_buffer[i].max_mean = 0;
+		cpu_buffer[i].governor_scale = PERIOD_SCALE_ONE;
+		cpu_buffer[i].period_scale = PERIOD_SCALE_ONE;
+		sync_clock(i);
+	}
+
+	if (kernel_syms_snapshot())
+		printk(KERN_INFO "rrprofile: no kernel symbol snapshot available.\n");
  #endif // RRPROFILE
 
 	if ((err = oprofile_ops.start()))
 		goto out;
+ #ifdef RRPROFILE
+	start_count_switch();
+ #endif // RRPROFILE
 
 	start_switch_worker();
+ #ifdef RRPROFILE
+	oprofile_governor_start();
+ #endif // RRPROFILE
 	
 	oprofile_started = 1;
 	atomic_set(&buffer_dump, 0);
@@ -262,21 +460,40 @@ void oprofile_stop(void)
 #endif // RRPROFILE
 	if (!oprofile_started)
 		goto out;
+#ifdef RRPROFILE
+	/* no event set switches while the counters are stopped */
+	stop_switch_worker();
+	stop_count_switch();
+	oprofile_governor_stop();
+#endif // RRPROFILE
 	oprofile_ops.stop();
 	oprofile_started = 0;
 
 #ifdef RRPROFILE
+	/* the counting mode totals up to the stop */
+	if (oprofile_ops.read_counts) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+		on_each_cpu(read_counts_cpu, NULL, 1);
+#else
+		on_each_cpu(read_counts_cpu, NULL, 0, 1);
+#endif
+	}
+
 	/* sync the cpu and the event buffers (dump remaining events in cpu buffers) */
+	sync_all_buffers();
+
 	for_each_online_cpu(i) {
-		sync_buffer(i);
+		sync_clock(i);
 	}
 
+	down(&buffer_sem);
 	add_event_entry(ESCAPE_CODE);
 	add_event_entry(RR_ADAPT_SAMPLING_INTERVAL_CODE);
 	add_event_entry(oprofile_adapt_value);
-#endif // RRPROFILE
-
+	up(&buffer_sem);
+#else
 	stop_switch_worker();
+#endif // RRPROFILE
 
 	/* wake up the daemon to read what remains */
 	wake_up_buffer_waiter();
@@ -290,36 +507,88 @@ out:
 
 #ifdef RRPROFILE
 #ifdef CONFIG_X86_LOCAL_APIC
+/* nonzero if the periods of @cpu stay within max_period when they are
+ * taken @factor times longer */
+static int adapt_fits(int cpu, unsigned long factor)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+	unsigned long max = oprofile_ops.max_period;
+
+	if (!max)
+		return 1;
+	max /= factor * b->adapt_weight;
+	return b->max_mean <= max && max;
+}
+
 int oprofile_adapt(void)
 {
-	int i;
 	int err = -EINVAL;
+	unsigned long value;
+	int cpu;
 
 	down(&start_sem);
 	if (!oprofile_started) {
 		goto out;
 	}
-	// stop
-	oprofile_ops.stop();
-	for_each_online_cpu(i) {
-		sync_buffer(i);
-	}
-
 	if(!oprofile_ops.adapt) {
 		goto out;
 	}
-	// fix up the counter values if possible
+	err = 0;
+
+	// a cpu adapted on its own may leave no room for all of them
+	for_each_online_cpu(cpu) {
+		if (cpu_buffer[cpu].adapt_weight > 1 &&
+		    !adapt_fits(cpu, ADAPT_DECAY_FACTOR))
+			goto out;
+	}
+
+	// fix up the counter values if possible. Sampling keeps running,
+	// each cpu picks up the new interval at its next overflow or timer
+	// pop and records that in its own stream, see oprofile_add_adapt().
+	// The value goes out first, so that a cpu reloading with the new
+	// interval can't record the old one.
+	value = oprofile_adapt_value;
+	oprofile_adapt_value = value * ADAPT_DECAY_FACTOR;
+	smp_wmb();
 	if(oprofile_ops.adapt()) {
-		oprofile_adapt_value *= ADAPT_DECAY_FACTOR;
+		down(&buffer_sem);
 		add_event_entry(ESCAPE_CODE);
 		add_event_entry(RR_ADAPT_SAMPLING_INTERVAL_CODE);
 		add_event_entry(oprofile_adapt_value);
+		up(&buffer_sem);
+	} else {
+		// refused before any interval changed
+		oprofile_adapt_value = value;
 	}
+out:
+	up(&start_sem);
 
-	// start
-	if ((err = oprofile_ops.start())) {
-		oprofile_started = 0;
-	}
+	return err;
+}
+
+/* Take the periods of @cpu alone ADAPT_DECAY_FACTOR times longer, for a
+ * cpu that samples far more than the others. The cpu records its weight
+ * at its next reload, see oprofile_add_adapt(). */
+int oprofile_adapt_cpu(unsigned long cpu)
+{
+	int err = -EINVAL;
+
+	down(&start_sem);
+	if (!oprofile_started)
+		goto out;
+	if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+		goto out;
+	/* the mode can't adapt a single cpu */
+	err = -EOPNOTSUPP;
+	if (!oprofile_ops.max_period)
+		goto out;
+	/* the periods of the cpu are as long as they go */
+	err = -ERANGE;
+	if (!adapt_fits(cpu, ADAPT_DECAY_FACTOR))
+		goto out;
+	err = 0;
+
+	cpu_buffer[cpu].adapt_weight *= ADAPT_DECAY_FACTOR;
 out:
 	up(&start_sem);
 
@@ -388,6 +657,13 @@ int oprofile_set_ulong(unsigned long *addr, unsigned long val)
 
 #ifdef RRPROFILE
 
+static struct oprofile_operations *event_ops(void)
+{
+	if (oprofile_event_backend == EVENT_BACKEND_PERF)
+		return &perf_ops;
+	return &arch_ops;
+}
+
 int oprofile_set_oprofile_timer_count(unsigned long val)
 {
 	int err = -EBUSY;
@@ -395,10 +671,12 @@ int oprofile_set_oprofile_timer_count(unsigned long val)
 	down(&start_sem);
 
 	if (!oprofile_started) {
-		if(val == 0 && arch_ops.cpu_type != NULL) {
+		if(val == 0 && event_ops()->cpu_type != NULL) {
 //			printk(KERN_INFO "rrprofile: switched to event mode.\n");
-			oprofile_ops = arch_ops;
+			oprofile_ops = *event_ops();
+			oprofile_num_counters = oprofile_ops.num_counters;
 			oprofile_timer_count = 0;
+			oprofile_timer_period = 0;
 		} else {
 //			printk(KERN_INFO "rrprofile: switched to timer mode.\n");
 			oprofile_ops = timer_ops;
@@ -412,6 +690,61 @@ int oprofile_set_oprofile_timer_count(unsigned long val)
 	return err;
 }
 
+int oprofile_set_oprofile_timer_period(unsigned long val)
+{
+	int err = -EBUSY;
+
+	if (val && val < TIMER_PERIOD_MIN)
+		return -EINVAL;
+
+	down(&start_sem);
+
+	if (!oprofile_started) {
+		if (val) {
+			oprofile_ops = timer_ops;
+			if (!oprofile_timer_count)
+				oprofile_timer_count = 1;
+		}
+		oprofile_timer_period = val;
+
+		err = 0;
+	}
+
+	up(&start_sem);
+	return err;
+}
+
+int oprofile_set_event_backend(unsigned long val)
+{
+	struct oprofile_operations *ops;
+	int err = -EBUSY;
+
+	if (val == EVENT_BACKEND_PERF)
+		ops = &perf_ops;
+	else if (val == EVENT_BACKEND_NATIVE)
+		ops = &arch_ops;
+	else
+		return -EINVAL;
+
+	if (ops->cpu_type == NULL)
+		return -ENODEV;
+
+	down(&start_sem);
+
+	if (!oprofile_started) {
+		oprofile_event_backend = val;
+		if (!oprofile_timer_count) {
+			oprofile_ops = *ops;
+			oprofile_num_counters = ops->num_counters;
+		}
+
+		err = 0;
+	}
+
+	up(&start_sem);
+	return err;
+}
+
 #endif // RRPROFILE
 
 
@@ -431,6 +764,14 @@ static int __init oprofile_init(void)
 	memset(&arch_ops, 0, sizeof(struct oprofile_operations));
 	err = oprofile_arch_init(&arch_ops);
 
+	memset(&perf_ops, 0, sizeof(struct oprofile_operations));
+	if (oprofile_perf_init(&perf_ops) < 0)
+		perf_ops.cpu_type = NULL;
+	else if (err >= 0)
+		/* same events, so the same event tables in user space */
+		perf_ops.cpu_type = arch_ops.cpu_type;
+	perf_ops.backtrace = arch_ops.backtrace;
+
 #if 0
 #if defined(__PPC__) || defined(__PPC64__) || defined(__ppc__) || defined(__ppc64__)
 	/* Enable backtracing for OS timer - this only works for PowerPC? */
@@ -447,7 +788,13 @@ static int __init oprofile_init(void)
 	timer_ops.backtrace = arch_ops.backtrace;
 #endif
 	
-	if(err < 0) {
+	if(err < 0 && perf_ops.cpu_type != NULL) {
+		printk(KERN_INFO "rrprofile: timer and perf event modes available.\n");
+		arch_ops.cpu_type = NULL;
+		oprofile_event_backend = EVENT_BACKEND_PERF;
+		oprofile_num_counters = perf_ops.num_counters;
+		oprofile_ops = perf_ops;
+	} else if(err < 0) {
 		printk(KERN_INFO "rrprofile: only timer mode available.\n");
 		arch_ops.cpu_type = NULL;
 		oprofile_num_counters = 0;
@@ -487,6 +834,10 @@ static void __exit oprofile_exit(void)
 	oprofile_timer_exit();
 	oprofilefs_unregister();
 	oprofile_arch_exit();
+#ifdef RRPROFILE
+	oprofile_perf_exit();
+	kernel_syms_free();
+#endif // RRPROFILE
 }
 
 
@@ -10,6 +10,10 @@
 #ifndef OPROF_H
 #define OPROF_H
 
+#ifdef RRPROFILE
+#include <linux/version.h>
+#endif // RRPROFILE
+
 int oprofile_setup(void);
 void oprofile_shutdown(void);
 
@@ -33,7 +37,27 @@ extern unsigned long oprofile_started;
 extern unsigned long oprofile_backtrace_depth;
 #ifdef RRPROFILE
 extern unsigned long oprofile_timer_count;
+extern unsigned long oprofile_timer_period;
 extern unsigned long oprofile_adapt_value;
+extern unsigned long oprofile_merge_window;
+extern unsigned long oprofile_timestamp_ns;
+extern unsigned long oprofile_clock_sync_interval;
+extern unsigned long oprofile_sample_jitter;
+extern unsigned long oprofile_timer_idle_skip;
+extern unsigned long oprofile_event_backend;
+extern unsigned long oprofile_time_slice;
+extern unsigned long oprofile_count_per_task;
+extern unsigned long oprofile_overhead_budget;
+/* held by start, stop, adapt and the governor */
+extern struct semaphore start_sem;
+
+/* event multiplexing needs delayed work that can be cancelled synchronously */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27) && !defined(CONFIG_OPROFILE_EVENT_MULTIPLEX)
+#define CONFIG_OPROFILE_EVENT_MULTIPLEX 1
+#endif
+
+/* largest sample_jitter in percent of the mean period */
+#define SAMPLE_JITTER_MAX	90
 #endif // RRPROFILE
 
 struct super_block;
@@ -49,9 +73,36 @@ int oprofile_set_timeout(unsigned long time);
 #ifdef RRPROFILE
 int oprofile_set_oprofile_timer_count(unsigned long val);
 
+/* shortest timer period in nsecs, keeps the timer from starving the cpu */
+#define TIMER_PERIOD_MIN	10000
+int oprofile_set_oprofile_timer_period(unsigned long val);
+
+/* event_backend values: how event mode drives the counters */
+#define EVENT_BACKEND_NATIVE	0	/* counter MSRs, NMI handler */
+#define EVENT_BACKEND_PERF	1	/* kernel perf_event counters */
+int oprofile_set_event_backend(unsigned long val);
+
+/* tids or tgids of the tasks sampling follows, none for all */
+#define TASK_FILTER_MAX		16
+extern pid_t oprofile_task_filter[TASK_FILTER_MAX];
+extern int oprofile_task_filter_nr;
+int oprofile_set_task_filter(pid_t const *pids, int nr);
+
+/* counters offered by the perf_event backend, in perf/N */
+#define OP_PERF_MAX_COUNTERS	8
+int oprofile_perf_init(struct oprofile_operations *ops);
+void oprofile_perf_exit(void);
+int oprofile_perf_create_files(struct super_block *sb, struct dentry *root);
+
 #ifdef CONFIG_X86_LOCAL_APIC
 int oprofile_adapt(void);
+int oprofile_adapt_cpu(unsigned long cpu);
 #endif
+
+/* overhead_budget is in 1/10000 of the cpu time, i.e. 100 is 1% */
+#define OVERHEAD_BUDGET_MAX	10000
+void oprofile_governor_start(void);
+void oprofile_governor_stop(void);
 #endif // RRPROFILE
  
 #endif /* OPROF_H */
@@ -13,11 +13,16 @@
 #include <linux/fs.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/threads.h>
 #include <asm/param.h>
+#include <asm/uaccess.h>
 
 #include "event_buffer.h"
 #include "oprofile_stats.h"
 #include "oprof.h"
+#ifdef RRPROFILE
+#include "kernel_syms.h"
+#endif // RRPROFILE
 
 #define BUFFER_SIZE_DEFAULT		131072
 #define CPU_BUFFER_SIZE_DEFAULT		8192
@@ -35,6 +40,26 @@ unsigned long oprofile_time_slice;
 char          oprofile_cpu_type[80] = "null";
 unsigned int  oprofile_num_counters = 0;
 
+/* Reorder window in usecs for the time-ordered event stream, 0 disables it. */
+unsigned long oprofile_merge_window;
+
+#define CLOCK_SYNC_INTERVAL_DEFAULT	1000
+
+/* Emit timestamps as CLOCK_MONOTONIC nsecs instead of raw timebase ticks. */
+unsigned long oprofile_timestamp_ns;
+/* msecs between clock correlation records, 0 only records them on start/stop. */
+unsigned long oprofile_clock_sync_interval;
+/* Jitter of each sampling period, in percent of the mean, 0 disables it. */
+unsigned long oprofile_sample_jitter;
+/* Suspend the sampling timer of idle cpus, recording idle time instead. */
+unsigned long oprofile_timer_idle_skip;
+/* Also read counting mode counters on context switches, per task totals. */
+unsigned long oprofile_count_per_task;
+/* Attach what every active counter counted since the last sample to each sample. */
+unsigned long oprofile_sample_group;
+/* Sampling overhead to hold each cpu at, in 1/10000 of its time, 0 disables it. */
+unsigned long oprofile_overhead_budget;
+
 #if !defined(CONFIG_X86_64) && LINUX_VERSION_CODE < KERNEL_VERSION(2,6,15)
 extern unsigned long cpu_khz;
 #else
@@ -43,9 +68,6 @@ extern unsigned int cpu_khz;
 
 extern int rrprofile_debug;
 
-// not supported (yet)
-#undef CONFIG_OPROFILE_EVENT_MULTIPLEX
-
 #endif // RRPROFILE
 
 #ifdef CONFIG_OPROFILE_EVENT_MULTIPLEX
@@ -300,6 +322,148 @@ static const struct file_operations oprofile_timer_count_fops = {
 #endif // >= 2.6.37
 };
 
+static ssize_t timer_period_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	return oprofilefs_ulong_to_user(oprofile_timer_period, buf, count, offset);
+}
+
+
+static ssize_t timer_period_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	unsigned long val;
+	int retval;
+
+	if (*offset)
+		return -EINVAL;
+
+	if(test_bit(0, &buffer_opened)) {
+		return -EINVAL;
+	}
+
+	retval = oprofilefs_ulong_from_user(&val, buf, count);
+	if (retval) {
+		return retval;
+	}
+
+	retval = oprofile_set_oprofile_timer_period(val);
+	if(retval) {
+		return retval;
+	}
+
+	return count;
+}
+
+static const struct file_operations oprofile_timer_period_fops = {
+    .read		= timer_period_read,
+    .write 		= timer_period_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+static ssize_t event_backend_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	return oprofilefs_ulong_to_user(oprofile_event_backend, buf, count, offset);
+}
+
+
+static ssize_t event_backend_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	unsigned long val;
+	int retval;
+
+	if (*offset)
+		return -EINVAL;
+
+	if(test_bit(0, &buffer_opened)) {
+		return -EINVAL;
+	}
+
+	retval = oprofilefs_ulong_from_user(&val, buf, count);
+	if (retval) {
+		return retval;
+	}
+
+	retval = oprofile_set_event_backend(val);
+	if(retval) {
+		return retval;
+	}
+
+	return count;
+}
+
+static const struct file_operations event_backend_fops = {
+    .read		= event_backend_read,
+    .write 		= event_backend_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+/* room for TASK_FILTER_MAX pids and their separators */
+#define TASK_FILTER_CHARS	(TASK_FILTER_MAX * 12)
+
+static ssize_t task_filter_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	char str[TASK_FILTER_CHARS + 2];
+	int i, len = 0;
+
+	for (i = 0; i < oprofile_task_filter_nr; ++i)
+		len += snprintf(str + len, sizeof(str) - len, "%s%d",
+				i ? " " : "", oprofile_task_filter[i]);
+	snprintf(str + len, sizeof(str) - len, "\n");
+
+	return oprofilefs_str_to_user(str, buf, count, offset);
+}
+
+
+/* a list of tids or tgids, separated by spaces or commas */
+static ssize_t task_filter_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	char str[TASK_FILTER_CHARS + 1];
+	pid_t pids[TASK_FILTER_MAX];
+	unsigned long pid;
+	char *p, *end;
+	int nr = 0;
+	int retval;
+
+	if (*offset || count > TASK_FILTER_CHARS)
+		return -EINVAL;
+
+	if (copy_from_user(str, buf, count))
+		return -EFAULT;
+	str[count] = 0;
+
+	for (p = str; *p; p = end) {
+		pid = simple_strtoul(p, &end, 10);
+		if (end == p) {
+			if (*p != ' ' && *p != ',' && *p != '\n')
+				return -EINVAL;
+			++end;
+			continue;
+		}
+		if (!pid)
+			continue;
+		if (nr == TASK_FILTER_MAX || pid > PID_MAX_LIMIT)
+			return -EINVAL;
+		pids[nr++] = pid;
+	}
+
+	retval = oprofile_set_task_filter(pids, nr);
+	if (retval)
+		return retval;
+
+	return count;
+}
+
+static const struct file_operations task_filter_fops = {
+	.read		= task_filter_read,
+	.write		= task_filter_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
 static ssize_t timer_freq_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
 {
 #if defined(CONFIG_HZ_100) || defined(CONFIG_HZ_250) || defined(CONFIG_HZ_1000)
@@ -338,15 +502,21 @@ static ssize_t cpu_khz_read(struct file * file, char __user * buf, size_t count,
 
 #if defined(CONFIG_CPU_FREQ) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,15)
 	struct cpufreq_policy *policy;
-
-	// Only the processor frequency for CPU 0.
-	// **** Has to change if we support asymmetric multiprocessing systems.  	
-	policy = cpufreq_cpu_get(0);
-	if (policy == NULL) {
-		freq = cpu_khz;
-	} else {
-		freq = policy->cpuinfo.max_freq;
+	int i;
+
+	// The highest maximum frequency of all online processors, per-CPU
+	// timebase rates are in stats/cpuN/clock_khz.
+	freq = 0;
+	for_each_online_cpu(i) {
+		policy = cpufreq_cpu_get(i);
+		if (policy == NULL)
+			continue;
+		if (policy->cpuinfo.max_freq > freq)
+			freq = policy->cpuinfo.max_freq;
+		cpufreq_cpu_put(policy);
 	}
+	if (freq == 0)
+		freq = cpu_khz;
 #else
 	freq = cpu_khz;
 #endif
@@ -394,6 +564,32 @@ static const struct file_operations adapt_fops = {
 	.llseek		= default_llseek,
 #endif // >= 2.6.37
 };
+
+/* echo N > adapt_cpu adapts cpu N alone */
+static ssize_t adapt_cpu_write(struct file *file, char const __user *buf, size_t count, loff_t *offset)
+{
+	unsigned long val;
+	int retval;
+
+	if (*offset)
+		return -EINVAL;
+
+	retval = oprofilefs_ulong_from_user(&val, buf, count);
+	if (retval)
+		return retval;
+
+	retval = oprofile_adapt_cpu(val);
+	if (retval)
+		return retval;
+	return count;
+}
+
+static const struct file_operations adapt_cpu_fops = {
+	.write		= adapt_cpu_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= noop_llseek,
+#endif // >= 2.6.37
+};
 #endif
 
 #endif // RRPROFILE
@@ -405,6 +601,9 @@ void oprofile_create_files(struct super_block * sb, struct dentry * root)
 	oprofile_cpu_buffer_size =	CPU_BUFFER_SIZE_DEFAULT;
 	oprofile_buffer_watershed =	BUFFER_WATERSHED_DEFAULT;
 	oprofile_time_slice =		msecs_to_jiffies(TIME_SLICE_DEFAULT);
+#ifdef RRPROFILE
+	oprofile_clock_sync_interval =	CLOCK_SYNC_INTERVAL_DEFAULT;
+#endif // RRPROFILE
 
 #ifdef RRPROFILE
 	oprofilefs_create_file_perm(sb, root, "enable", &enable_fops, 0666);
@@ -424,16 +623,34 @@ void oprofile_create_files(struct super_block * sb, struct dentry * root)
 	oprofilefs_create_file(sb, root, "backtrace_depth", &depth_fops);
 	oprofilefs_create_file(sb, root, "pointer_size", &pointer_size_fops);
 #ifdef CONFIG_OPROFILE_EVENT_MULTIPLEX
+#ifdef RRPROFILE
+	oprofilefs_create_file_perm(sb, root, "time_slice", &timeout_fops, 0666);
+#else
 	oprofilefs_create_file(sb, root, "time_slice", &timeout_fops);
+#endif // RRPROFILE
 #endif
 #ifdef RRPROFILE
 	oprofilefs_create_file_perm(sb, root, "timer_count", &oprofile_timer_count_fops, 0666);
+	oprofilefs_create_file_perm(sb, root, "timer_period_ns", &oprofile_timer_period_fops, 0666);
 	oprofilefs_create_file(sb, root, "timer_freq", &timer_freq_fops);
 	oprofilefs_create_file(sb, root, "user_freq", &user_freq_fops);
 	oprofilefs_create_file(sb, root, "cpu_khz", &cpu_khz_fops);
 	oprofilefs_create_file(sb, root, "num_counters", &num_counters_fops);
+	oprofilefs_create_ulong(sb, root, "merge_window", &oprofile_merge_window);
+	oprofilefs_create_ulong(sb, root, "timestamp_ns", &oprofile_timestamp_ns);
+	oprofilefs_create_ulong(sb, root, "clock_sync_interval", &oprofile_clock_sync_interval);
+	oprofilefs_create_file_perm(sb, root, "kallsyms", &kernel_syms_fops, 0400);
+	oprofilefs_create_ulong(sb, root, "sample_jitter", &oprofile_sample_jitter);
+	oprofilefs_create_ulong(sb, root, "timer_idle_skip", &oprofile_timer_idle_skip);
+	oprofilefs_create_file_perm(sb, root, "event_backend", &event_backend_fops, 0666);
+	oprofilefs_create_ulong(sb, root, "count_per_task", &oprofile_count_per_task);
+	oprofilefs_create_ulong(sb, root, "sample_group", &oprofile_sample_group);
+	oprofilefs_create_file_perm(sb, root, "task_filter", &task_filter_fops, 0666);
+	oprofilefs_create_ulong(sb, root, "overhead_budget", &oprofile_overhead_budget);
+	oprofile_perf_create_files(sb, root);
 #ifdef CONFIG_X86_LOCAL_APIC
 	oprofilefs_create_file_perm(sb, root, "adapt", &adapt_fops, 0666);
+	oprofilefs_create_file_perm(sb, root, "adapt_cpu", &adapt_cpu_fops, 0666);
 #endif
 	oprofilefs_create_file_perm(sb, root, "debug", &debug_fops, 0666);
 #endif // RRPROFILE
@@ -0,0 +1,180 @@
+/**
+ * @file oprofile_governor.c
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Keeps the sampling overhead within the "overhead_budget" without
+ * hand-tuned counts. Every GOVERNOR_INTERVAL_MS the time each cpu spent
+ * in the sampling interrupt and in syncing its buffer is compared to the
+ * budget, and the periods of that cpu are scaled by the ratio, at most
+ * doubled or halved per step and never below the configured ones. A cpu
+ * buffer that lost samples or is filling up counts as over budget. Every
+ * change is recorded as RR_PERIOD_SCALE_CODE with the cpu and its scale,
+ * and when the cpu took it over as RR_CPU_PERIOD_SCALE_CODE.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <asm/div64.h>
+
+#include "../oprofile.h"
+#include "oprof.h"
+#include "cpu_buffer.h"
+#include "event_buffer.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+
+#define GOVERNOR_INTERVAL_MS	250
+/* periods are scaled up to 65536 times the configured ones */
+#define PERIOD_SCALE_MAX	(PERIOD_SCALE_ONE << 16)
+
+static uint64_t last_tb;
+static int governor_running;
+/* overhead_budget in millionths, as taken at start */
+static unsigned long target_load;
+
+static void governor_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(governor_work, governor_worker);
+
+/* overhead of @cpu since the last tick, in millionths of @elapsed */
+static unsigned long governor_load(int cpu, uint64_t elapsed)
+{
+	struct oprofile_cpu_buffer *b = &cpu_buffer[cpu];
+	uint64_t used = b->overhead_tb - b->governor_overhead_tb;
+	unsigned long load = 0;
+	unsigned long free;
+
+	b->governor_overhead_tb = b->overhead_tb;
+
+	if (elapsed) {
+		used = div64_u64(used * 1000000, elapsed);
+		load = used > ULONG_MAX ? ULONG_MAX : (unsigned long)used;
+	}
+
+	/* dropped samples cost more than any budget allows */
+	free = b->buffer_size - (b->head_pos - b->tail_pos + b->buffer_size) % b->buffer_size;
+	if (b->sample_lost_overflow != b->governor_lost || free < b->buffer_size / 4)
+		load = max(load, target_load * 2);
+	b->governor_lost = b->sample_lost_overflow;
+
+	return load;
+}
+
+static unsigned long governor_next_scale(unsigned long scale,
+					 unsigned long load)
+{
+	unsigned long target = target_load;
+	uint64_t next;
+
+	/* leave some slack either side of the budget */
+	if (load <= target + target / 8 && load >= target - target / 4)
+		return scale;
+
+	/* the overhead goes with the sampling rate, i.e. 1 / period */
+	next = (uint64_t)scale * load;
+	do_div(next, target);
+
+	if (next > (uint64_t)scale * 2)
+		next = (uint64_t)scale * 2;
+	if (next < scale / 2)
+		next = scale / 2;
+	if (next > PERIOD_SCALE_MAX)
+		next = PERIOD_SCALE_MAX;
+	if (next < PERIOD_SCALE_ONE)
+		next = PERIOD_SCALE_ONE;
+
+	return (unsigned long)next;
+}
+
+/* the cpu takes @scale over at its next reload, see oprofile_add_adapt() */
+static void governor_set_scale(int cpu, unsigned long scale)
+{
+	cpu_buffer[cpu].governor_scale = scale;
+
+	down(&buffer_sem);
+	add_event_entry(ESCAPE_CODE);
+	add_event_entry(RR_PERIOD_SCALE_CODE);
+	add_event_entry(cpu);
+	add_event_entry(scale);
+	up(&buffer_sem);
+}
+
+static void governor_worker(struct work_struct *work)
+{
+	uint64_t now = oprofile_get_tb();
+	unsigned long scale;
+	int cpu;
+
+	/* oprofile_stop() cancels this work holding start_sem, so don't
+	 * wait for it. A skipped tick is taken into the next one. */
+	if (down_trylock(&start_sem))
+		goto out;
+
+	for_each_online_cpu(cpu) {
+		scale = cpu_buffer[cpu].governor_scale;
+		scale = governor_next_scale(scale, governor_load(cpu, now - last_tb));
+		if (scale != cpu_buffer[cpu].governor_scale)
+			governor_set_scale(cpu, scale);
+	}
+	last_tb = now;
+	up(&start_sem);
+
+out:
+	schedule_delayed_work(&governor_work,
+			      msecs_to_jiffies(GOVERNOR_INTERVAL_MS));
+}
+
+void oprofile_governor_start(void)
+{
+	int cpu;
+
+	if (!oprofile_overhead_budget)
+		return;
+
+	if (!oprofile_ops.max_period) {
+		printk(KERN_INFO "rrprofile: overhead_budget not supported in this mode.\n");
+		return;
+	}
+
+	if (oprofile_overhead_budget > OVERHEAD_BUDGET_MAX)
+		oprofile_overhead_budget = OVERHEAD_BUDGET_MAX;
+	target_load = oprofile_overhead_budget * 100;
+
+	for_each_possible_cpu(cpu) {
+		cpu_buffer[cpu].governor_overhead_tb = cpu_buffer[cpu].overhead_tb;
+		cpu_buffer[cpu].governor_lost = cpu_buffer[cpu].sample_lost_overflow;
+	}
+	last_tb = oprofile_get_tb();
+
+	governor_running = 1;
+	schedule_delayed_work(&governor_work,
+			      msecs_to_jiffies(GOVERNOR_INTERVAL_MS));
+}
+
+void oprofile_governor_stop(void)
+{
+	if (!governor_running)
+		return;
+
+	governor_running = 0;
+	cancel_delayed_work_sync(&governor_work);
+}
+
+#else
+
+void oprofile_governor_start(void)
+{
+	if (oprofile_overhead_budget)
+		printk(KERN_INFO "rrprofile: overhead_budget not supported on this kernel.\n");
+}
+
+void oprofile_governor_stop(void)
+{
+}
+
+#endif
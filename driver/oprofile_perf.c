@@ -0,0 +1,370 @@
+/**
+ * @file oprofile_perf.c
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Event sampling through the kernel's perf_event subsystem instead of
+ * programming the counter MSRs directly. The kernel schedules the
+ * counters, so any raw event the PMU driver accepts can be sampled, on
+ * as many counters as it exposes, and sampling coexists with other
+ * perf users. Selected with the "event_backend" file.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+
+#include "../oprofile.h"
+#include "oprof.h"
+
+#if defined(CONFIG_PERF_EVENTS) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+
+#include <linux/perf_event.h>
+
+struct op_perf_counter {
+	unsigned long enabled;
+	unsigned long event;
+	unsigned long unit_mask;
+	unsigned long count;
+	unsigned long kernel;
+	unsigned long user;
+	unsigned long raw;
+	unsigned long freq;
+	unsigned long precise;
+};
+
+static struct op_perf_counter perf_counter_config[OP_PERF_MAX_COUNTERS];
+static struct perf_event_attr perf_attr[OP_PERF_MAX_COUNTERS];
+static DEFINE_PER_CPU(struct perf_event **, perf_events);
+static uint64_t start_timestamp[NR_CPUS];
+static int perf_available;
+static int ctr_running;
+
+/* raw config as the PMU driver expects it, unless set verbatim */
+static u64 perf_raw_config(struct op_perf_counter *ctr)
+{
+	u64 config;
+
+	if (ctr->raw)
+		return ctr->raw;
+
+	config = (ctr->event & 0xff) | ((ctr->unit_mask & 0xff) << 8);
+#ifdef CONFIG_X86
+	/* AMD extended event select bits 11:8 live in bits 35:32 */
+	config |= (u64)((ctr->event >> 8) & 0xf) << 32;
+#endif
+	return config;
+}
+
+static void perf_overflow_handler(struct perf_event *event,
+				  struct perf_sample_data *data,
+				  struct pt_regs *regs)
+{
+	int cpu = smp_processor_id();
+	unsigned long id = (unsigned long)event->overflow_handler_context;
+	uint64_t end_timestamp = oprofile_get_tb();
+
+	event->hw.interrupts = 0;       /* don't throttle interrupts */
+
+	oprofile_add_sample_start(start_timestamp[cpu]);
+	oprofile_add_sample_stop(end_timestamp);
+	oprofile_add_sample_period(event->hw.last_period);
+	oprofile_add_sample(regs, id);
+
+	start_timestamp[cpu] = oprofile_get_tb();
+	oprofile_add_overhead(end_timestamp);
+}
+
+static int perf_create_events(int cpu)
+{
+	struct perf_event **events = per_cpu(perf_events, cpu);
+	struct perf_event *event;
+	unsigned long i;
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		if (!perf_counter_config[i].enabled || events[i])
+			continue;
+
+		event = perf_event_create_kernel_counter(&perf_attr[i], cpu,
+				NULL, perf_overflow_handler, (void *)i);
+		if (IS_ERR(event)) {
+			printk(KERN_ERR "rrprofile: cannot create perf event %lu on cpu %d\n",
+			       i, cpu);
+			return PTR_ERR(event);
+		}
+		events[i] = event;
+	}
+
+	return 0;
+}
+
+static void perf_destroy_events(int cpu)
+{
+	struct perf_event **events = per_cpu(perf_events, cpu);
+	int i;
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		if (!events[i])
+			continue;
+		perf_event_disable(events[i]);
+		perf_event_release_kernel(events[i]);
+		events[i] = NULL;
+	}
+}
+
+static void perf_cpu_start(void *dummy)
+{
+	int cpu = smp_processor_id();
+
+	oprofile_add_start(NULL);
+	start_timestamp[cpu] = oprofile_get_tb();
+}
+
+static void perf_start_cpu(int cpu)
+{
+	struct perf_event **events = per_cpu(perf_events, cpu);
+	int i;
+
+	if (!ctr_running)
+		return;
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		if (events[i])
+			perf_event_enable(events[i]);
+	}
+}
+
+static void perf_stop_cpu(int cpu)
+{
+	struct perf_event **events = per_cpu(perf_events, cpu);
+	int i;
+
+	if (!ctr_running)
+		return;
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		if (events[i])
+			perf_event_disable(events[i]);
+	}
+}
+
+static int perf_cpu_notifier(struct notifier_block *b, unsigned long action,
+			     void *data)
+{
+	int cpu = (unsigned long)data;
+
+	switch (action) {
+	case CPU_DOWN_FAILED:
+	case CPU_ONLINE:
+		if (!perf_create_events(cpu))
+			perf_start_cpu(cpu);
+		break;
+	case CPU_DOWN_PREPARE:
+		perf_stop_cpu(cpu);
+		perf_destroy_events(cpu);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block perf_cpu_nb = {
+	.notifier_call = perf_cpu_notifier
+};
+
+static void perf_shutdown(void)
+{
+	int cpu;
+
+	get_online_cpus();
+	unregister_cpu_notifier(&perf_cpu_nb);
+	for_each_possible_cpu(cpu)
+		perf_destroy_events(cpu);
+	put_online_cpus();
+}
+
+static int perf_setup(void)
+{
+	struct perf_event_attr *attr;
+	int i, cpu, err, any_freq = 0;
+
+	spin_lock(&oprofilefs_lock);
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		attr = &perf_attr[i];
+		memset(attr, 0, sizeof(*attr));
+		attr->type = PERF_TYPE_RAW;
+		attr->size = sizeof(*attr);
+		attr->config = perf_raw_config(&perf_counter_config[i]);
+		/* perf adjusts the period to the frequency itself */
+		if (perf_counter_config[i].freq) {
+			attr->freq = 1;
+			attr->sample_freq = perf_counter_config[i].freq;
+			any_freq |= perf_counter_config[i].enabled;
+		} else {
+			attr->sample_period = perf_counter_config[i].count;
+		}
+		attr->exclude_kernel = !perf_counter_config[i].kernel;
+		attr->exclude_user = !perf_counter_config[i].user;
+		/* 0 allows any skid, 3 asks for none */
+		attr->precise_ip = min(perf_counter_config[i].precise, 3UL);
+		attr->pinned = 1;
+		attr->disabled = 1;
+	}
+	spin_unlock(&oprofilefs_lock);
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		if (perf_counter_config[i].enabled &&
+		    !perf_counter_config[i].count && !perf_counter_config[i].freq)
+			return -EINVAL;
+	}
+	oprofile_record_sample_periods(any_freq);
+
+	get_online_cpus();
+	err = register_cpu_notifier(&perf_cpu_nb);
+	if (err)
+		goto out;
+	/* can't attach events to offline cpus: */
+	for_each_online_cpu(cpu) {
+		err = perf_create_events(cpu);
+		if (err)
+			break;
+	}
+	if (err) {
+		unregister_cpu_notifier(&perf_cpu_nb);
+		for_each_possible_cpu(cpu)
+			perf_destroy_events(cpu);
+	}
+out:
+	put_online_cpus();
+	return err;
+}
+
+static int perf_start(void)
+{
+	int cpu;
+
+	get_online_cpus();
+	on_each_cpu(perf_cpu_start, NULL, 1);
+	ctr_running = 1;
+	for_each_online_cpu(cpu)
+		perf_start_cpu(cpu);
+	put_online_cpus();
+
+	return 0;
+}
+
+static void perf_stop(void)
+{
+	int cpu;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+		perf_stop_cpu(cpu);
+	ctr_running = 0;
+	on_each_cpu(oprofile_add_stop, NULL, 1);
+	put_online_cpus();
+}
+
+int oprofile_perf_create_files(struct super_block *sb, struct dentry *root)
+{
+	struct dentry *perf_dir, *dir;
+	char buf[4];
+	int i;
+
+	if (!perf_available)
+		return 0;
+
+	perf_dir = oprofilefs_mkdir(sb, root, "perf");
+
+	for (i = 0; i < OP_PERF_MAX_COUNTERS; ++i) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		dir = oprofilefs_mkdir(sb, perf_dir, buf);
+		oprofilefs_create_ulong(sb, dir, "enabled", &perf_counter_config[i].enabled);
+		oprofilefs_create_ulong(sb, dir, "event", &perf_counter_config[i].event);
+		oprofilefs_create_ulong(sb, dir, "count", &perf_counter_config[i].count);
+		oprofilefs_create_ulong(sb, dir, "unit_mask", &perf_counter_config[i].unit_mask);
+		oprofilefs_create_ulong(sb, dir, "kernel", &perf_counter_config[i].kernel);
+		oprofilefs_create_ulong(sb, dir, "user", &perf_counter_config[i].user);
+		oprofilefs_create_ulong(sb, dir, "raw", &perf_counter_config[i].raw);
+		oprofilefs_create_ulong(sb, dir, "freq", &perf_counter_config[i].freq);
+		oprofilefs_create_ulong(sb, dir, "precise", &perf_counter_config[i].precise);
+	}
+
+	return 0;
+}
+
+int __init oprofile_perf_init(struct oprofile_operations *ops)
+{
+	struct perf_event_attr attr;
+	struct perf_event *event;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(perf_events, cpu) = kcalloc(OP_PERF_MAX_COUNTERS,
+				sizeof(struct perf_event *), GFP_KERNEL);
+		if (!per_cpu(perf_events, cpu)) {
+			oprofile_perf_exit();
+			return -ENOMEM;
+		}
+	}
+
+	/* only check that the PMU is usable through perf, don't keep it */
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.size = sizeof(attr);
+	attr.sample_period = 1000000;
+	attr.disabled = 1;
+	event = perf_event_create_kernel_counter(&attr, raw_smp_processor_id(),
+			NULL, perf_overflow_handler, NULL);
+	if (IS_ERR(event)) {
+		oprofile_perf_exit();
+		return PTR_ERR(event);
+	}
+	perf_event_release_kernel(event);
+
+	ops->create_files	= NULL;
+	ops->setup		= perf_setup;
+	ops->shutdown		= perf_shutdown;
+	ops->start		= perf_start;
+	ops->stop		= perf_stop;
+	ops->cpu_type		= "perf";
+	ops->num_counters	= OP_PERF_MAX_COUNTERS;
+	perf_available = 1;
+
+	return 0;
+}
+
+void oprofile_perf_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(perf_events, cpu));
+		per_cpu(perf_events, cpu) = NULL;
+	}
+	perf_available = 0;
+}
+
+#else
+
+int oprofile_perf_create_files(struct super_block *sb, struct dentry *root)
+{
+	return 0;
+}
+
+int __init oprofile_perf_init(struct oprofile_operations *ops)
+{
+	return -ENODEV;
+}
+
+void oprofile_perf_exit(void)
+{
+}
+
+#endif
@@ -44,6 +44,8 @@ void oprofile_reset_stats(void)
 	atomic_set(&oprofile_stats.event_lost_overflow, 0);
 #ifdef RRPROFILE
 	atomic_set(&oprofile_stats.bt_lost_no_mapping, 0);
+	atomic_set(&oprofile_stats.merge_out_of_order, 0);
+	atomic_set(&oprofile_stats.multiplex_counter, 0);
 #endif // RRPROFILE
 }
 
@@ -81,6 +83,10 @@ void oprofile_create_stats_files(struct super_block *sb, struct dentry *root)
 			&cpu_buf->backtrace_aborted);
 		oprofilefs_create_ro_ulong(sb, cpudir, "sample_invalid_eip",
 			&cpu_buf->sample_invalid_eip);
+#ifdef RRPROFILE
+		oprofilefs_create_ro_ulong(sb, cpudir, "clock_khz",
+			&cpu_buf->clock_khz);
+#endif // RRPROFILE
 	}
 
 	oprofilefs_create_ro_atomic(sb, dir, "sample_lost_no_mm",
@@ -91,4 +97,10 @@ void oprofile_create_stats_files(struct super_block *sb, struct dentry *root)
 		&oprofile_stats.event_lost_overflow);
 	oprofilefs_create_ro_atomic(sb, dir, "bt_lost_no_mapping",
 		&oprofile_stats.bt_lost_no_mapping);
+#ifdef RRPROFILE
+	oprofilefs_create_ro_atomic(sb, dir, "merge_out_of_order",
+		&oprofile_stats.merge_out_of_order);
+	oprofilefs_create_ro_atomic(sb, dir, "multiplex_counter",
+		&oprofile_stats.multiplex_counter);
+#endif // RRPROFILE
 }
@@ -17,6 +17,10 @@ struct oprofile_stat_struct {
 	atomic_t sample_lost_no_mapping;
 	atomic_t bt_lost_no_mapping;
 	atomic_t event_lost_overflow;
+#ifdef RRPROFILE
+	atomic_t merge_out_of_order;
+	atomic_t multiplex_counter;
+#endif // RRPROFILE
 };
 
 extern struct oprofile_stat_struct oprofile_stats;
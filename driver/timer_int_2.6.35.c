@@ -37,8 +37,151 @@ static int ctr_running;
 #ifdef RRPROFILE
 #include <linux/kdebug.h>
 
+/* The x86 idle notifiers tell us when a cpu enters and leaves idle,
+ * they are only exported on x86_64. */
+#if defined(CONFIG_X86_64) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+#define HAVE_IDLE_NOTIFIER
+#include <asm/idle.h>
+#endif
+
 static int timer_pop[NR_CPUS];
 static uint64_t start_timestamp[NR_CPUS];
+/* stopped by the task_filter, with the nsecs left of the interval */
+static DEFINE_PER_CPU(int, task_off);
+static DEFINE_PER_CPU(s64, task_remaining);
+/* pops and nsecs of the interval running on each cpu */
+static unsigned long timer_target[NR_CPUS];
+static unsigned long timer_period[NR_CPUS];
+
+/* With a period set every expiry is a sample, otherwise the timer
+ * ticks at TICK_NSEC and samples every oprofile_timer_count pops.
+ * Pick the next interval of this cpu, jittered if so configured.
+ */
+static inline ktime_t timer_next_interval(int cpu)
+{
+	unsigned long period = oprofile_timer_period;
+
+	if (period) {
+		timer_target[cpu] = 1;
+		timer_period[cpu] = oprofile_jitter_period(period);
+		return ns_to_ktime(timer_period[cpu]);
+	}
+
+	timer_target[cpu] = oprofile_jitter_period(oprofile_timer_count);
+	timer_period[cpu] = timer_target[cpu] * TICK_NSEC;
+	return ns_to_ktime(TICK_NSEC);
+}
+
+#ifdef HAVE_IDLE_NOTIFIER
+static int idle_skip;
+static uint64_t idle_begin[NR_CPUS];
+
+/* Runs on the cpu itself with interrupts disabled, so the timer
+ * callback cannot be running concurrently.
+ */
+static int oprofile_idle_notify(struct notifier_block *self,
+				unsigned long action, void *data)
+{
+	int cpu = smp_processor_id();
+	struct hrtimer *hrtimer = &per_cpu(oprofile_hrtimer, cpu);
+	uint64_t now;
+
+	if (!idle_skip)
+		return NOTIFY_OK;
+
+	switch (action) {
+	case IDLE_START:
+		hrtimer_try_to_cancel(hrtimer);
+		idle_begin[cpu] = oprofile_get_tb();
+		break;
+	case IDLE_END:
+		if (!idle_begin[cpu])
+			break;
+		now = oprofile_get_tb();
+		oprofile_add_idle(idle_begin[cpu], now);
+		idle_begin[cpu] = 0;
+
+		/* the interval restarts, nothing before idle is sampled */
+		timer_pop[cpu] = 0;
+		start_timestamp[cpu] = now;
+		if (!per_cpu(task_off, cpu))
+			hrtimer_start(hrtimer, timer_next_interval(cpu),
+				      HRTIMER_MODE_REL_PINNED);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oprofile_idle_nb = {
+	.notifier_call = oprofile_idle_notify,
+};
+
+static void idle_skip_start(void)
+{
+	int cpu;
+
+	if (!oprofile_timer_idle_skip)
+		return;
+
+	for_each_possible_cpu(cpu)
+		idle_begin[cpu] = 0;
+	idle_skip = 1;
+	idle_notifier_register(&oprofile_idle_nb);
+}
+
+static void idle_skip_stop(void)
+{
+	if (!idle_skip)
+		return;
+
+	idle_skip = 0;
+	/* waits for running notifiers, so none can re-arm a timer after */
+	idle_notifier_unregister(&oprofile_idle_nb);
+}
+#else
+static void idle_skip_start(void)
+{
+	if (oprofile_timer_idle_skip)
+		printk(KERN_INFO "rrprofile: timer_idle_skip not supported on this kernel.\n");
+}
+
+static void idle_skip_stop(void) { }
+#endif // HAVE_IDLE_NOTIFIER
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+/* the interval left when a followed task switched out goes on when one
+ * switches in again */
+static void timer_task_scope(int on)
+{
+	int cpu = smp_processor_id();
+	struct hrtimer *hrtimer = &per_cpu(oprofile_hrtimer, cpu);
+	ktime_t interval;
+
+	if (!ctr_running)
+		return;
+
+	if (!on) {
+		per_cpu(task_off, cpu) = 1;
+		per_cpu(task_remaining, cpu) =
+			ktime_to_ns(hrtimer_get_remaining(hrtimer));
+		hrtimer_try_to_cancel(hrtimer);
+		return;
+	}
+
+	per_cpu(task_off, cpu) = 0;
+	interval = ns_to_ktime(max_t(s64, per_cpu(task_remaining, cpu),
+				     NSEC_PER_USEC));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+	/* this runs under the rq lock, an expired timer mustn't wake
+	 * ksoftirqd, as the scheduler's own hrtimers don't */
+	__hrtimer_start_range_ns(hrtimer, interval, 0,
+				 HRTIMER_MODE_REL_PINNED, 0);
+#else
+	hrtimer_start(hrtimer, interval, HRTIMER_MODE_REL_PINNED);
+#endif
+}
+#endif
 #endif // RRROFILE
 
 static enum hrtimer_restart oprofile_hrtimer_notify(struct hrtimer *hrtimer)
@@ -46,22 +189,27 @@ static enum hrtimer_restart oprofile_hrtimer_notify(struct hrtimer *hrtimer)
 #ifdef RRPROFILE
 	int cpu = smp_processor_id();
 	uint64_t end_timestamp = oprofile_get_tb();
+	ktime_t interval = ns_to_ktime(TICK_NSEC);
 
 	timer_pop[cpu]++;
 
-	if(timer_pop[cpu] >= oprofile_timer_count) {
+	if(timer_pop[cpu] >= timer_target[cpu]) {
 		oprofile_add_sample_start(start_timestamp[cpu]);
 		oprofile_add_sample_stop(end_timestamp);
+		oprofile_add_sample_period(timer_period[cpu]);
 		oprofile_add_sample(get_irq_regs(), 0);
 
 		timer_pop[cpu] = 0;
 		start_timestamp[cpu] = oprofile_get_tb();
+		oprofile_add_adapt();
+		interval = timer_next_interval(cpu);
 	}
-	// TODO: allow for arbitrary specification of time interval (not just increments of TICK_NSEC)
+	hrtimer_forward_now(hrtimer, interval);
+	oprofile_add_overhead(end_timestamp);
 #else
 	oprofile_add_sample(get_irq_regs(), 0);
-#endif // RRPROFILE
 	hrtimer_forward_now(hrtimer, ns_to_ktime(TICK_NSEC));
+#endif // RRPROFILE
 	return HRTIMER_RESTART;
 }
 
@@ -84,13 +232,18 @@ static void __oprofile_hrtimer_start(void *unused)
 	hrtimer_init(hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	hrtimer->function = oprofile_hrtimer_notify;
 
+#ifdef RRPROFILE
+	cpu = smp_processor_id();
+	hrtimer_start(hrtimer, timer_next_interval(cpu), HRTIMER_MODE_REL_PINNED);
+#else
 	hrtimer_start(hrtimer, ns_to_ktime(TICK_NSEC),
 		      HRTIMER_MODE_REL_PINNED);
+#endif // RRPROFILE
 
 #ifdef RRPROFILE
-	cpu = smp_processor_id();
 	timer_pop[cpu] = 0;
 	start_timestamp[cpu] = oprofile_get_tb();
+	per_cpu(task_off, cpu) = 0;
 #endif // RRPROFILE
 }
 
@@ -101,6 +254,9 @@ static int oprofile_hrtimer_start(void)
 	ctr_running = 1;
 #endif // >= 2.6.37
 	on_each_cpu(__oprofile_hrtimer_start, NULL, 1);
+#ifdef RRPROFILE
+	idle_skip_start();
+#endif // RRPROFILE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
 	put_online_cpus();
 #endif // >= 2.6.37
@@ -126,6 +282,9 @@ static void oprofile_hrtimer_stop(void)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
 	get_online_cpus();
 #endif // >= 2.6.37
+#ifdef RRPROFILE
+	idle_skip_stop();
+#endif // RRPROFILE
 	for_each_online_cpu(cpu)
 		__oprofile_hrtimer_stop(cpu);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
@@ -136,9 +295,17 @@ static void oprofile_hrtimer_stop(void)
 
 #ifdef RRPROFILE
 #define MAX_COUNTER_VALUE		(INT_MAX / ADAPT_DECAY_FACTOR)
+#define MAX_PERIOD_VALUE		(ULONG_MAX / ADAPT_DECAY_FACTOR)
 
 static int timer_adapt(void)
 {
+	if (oprofile_timer_period) {
+		if (oprofile_timer_period >= MAX_PERIOD_VALUE)
+			return 0;
+		oprofile_timer_period *= ADAPT_DECAY_FACTOR;
+		return 1;
+	}
+
 	if(oprofile_timer_count >= MAX_COUNTER_VALUE) {
 		return 0;
 	}
@@ -193,6 +360,8 @@ int oprofile_timer_init(struct oprofile_operations *ops)
 	ops->stop		= oprofile_hrtimer_stop;
 #ifdef RRPROFILE
 	ops->adapt = timer_adapt;
+	ops->max_period = INT_MAX;
+	ops->task_scope = timer_task_scope;
 	ops->backtrace = NULL;
 #endif // RRPROFILE
 	ops->cpu_type		= "timer";
@@ -220,6 +389,7 @@ int __init oprofile_timer_init(struct oprofile_operations *ops)
 	ops->stop = oprofile_hrtimer_stop;
 #ifdef RRPROFILE
 	ops->adapt = timer_adapt;
+	ops->max_period = INT_MAX;
 	ops->backtrace = NULL;
 #endif // RRPROFILE
 	ops->cpu_type = "timer";
@@ -32,6 +32,20 @@
 
 static int timer_pop[NR_CPUS];
 static uint64_t start_timestamp[NR_CPUS];
+/* ticks of the interval running on each cpu */
+static unsigned long timer_target[NR_CPUS];
+
+/* The tick hook cannot do better than whole ticks, round a period
+ * setting up to them.
+ */
+static inline unsigned long timer_pops(void)
+{
+	unsigned long period = oprofile_timer_period;
+
+	if (period)
+		return (period + TICK_NSEC - 1) / TICK_NSEC;
+	return oprofile_timer_count;
+}
 
 #if LINUX_VERSION_CODE >=  KERNEL_VERSION(2,6,15)
 static int timer_notify(struct pt_regs *regs)
@@ -46,14 +60,18 @@ static int timer_notify(struct notifier_block * self, unsigned long val, void *
 
 	timer_pop[cpu]++;
 
-	if(timer_pop[cpu] >= oprofile_timer_count) {
+	if(timer_pop[cpu] >= timer_target[cpu]) {
 		oprofile_add_sample_start(start_timestamp[cpu]);
 		oprofile_add_sample_stop(end_timestamp);
+		oprofile_add_sample_period(timer_target[cpu] * TICK_NSEC);
 		oprofile_add_sample(regs, 0);
 
 		timer_pop[cpu] = 0;
+		timer_target[cpu] = oprofile_jitter_period(timer_pops());
 		start_timestamp[cpu] = oprofile_get_tb();
+		oprofile_add_adapt();
 	}
+	oprofile_add_overhead(end_timestamp);
 	return 0;
 }
 
@@ -68,11 +86,15 @@ static void timer_cpu_init(void *arg)
 {
 	int cpu = smp_processor_id();
 	timer_pop[cpu] = 0;
+	timer_target[cpu] = oprofile_jitter_period(timer_pops());
 	start_timestamp[cpu] = oprofile_get_tb();
 }
 
 static int timer_start(void)
 {
+	if (oprofile_timer_idle_skip)
+		printk(KERN_INFO "rrprofile: timer_idle_skip not supported on this kernel.\n");
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
 	on_each_cpu(timer_cpu_init, NULL, 1);
 	on_each_cpu(oprofile_add_start, NULL, 1);
@@ -104,9 +126,17 @@ static void timer_stop(void)
 }
 
 #define MAX_COUNTER_VALUE		(INT_MAX / ADAPT_DECAY_FACTOR)
+#define MAX_PERIOD_VALUE		(ULONG_MAX / ADAPT_DECAY_FACTOR)
 
 static int timer_adapt(void)
 {
+	if (oprofile_timer_period) {
+		if (oprofile_timer_period >= MAX_PERIOD_VALUE)
+			return 0;
+		oprofile_timer_period *= ADAPT_DECAY_FACTOR;
+		return 1;
+	}
+
 	if(oprofile_timer_count >= MAX_COUNTER_VALUE) {
 		return 0;
 	}
@@ -146,6 +176,7 @@ int oprofile_timer_init(struct oprofile_operations *ops)
 	ops->stop = timer_stop;
 #ifdef RRPROFILE
 	ops->adapt = timer_adapt;
+	ops->max_period = INT_MAX;
 	ops->backtrace = NULL;
 #endif // RRPROFILE
 	ops->cpu_type = "timer";
@@ -44,6 +44,20 @@
 #define RR_SAMPLE_BEGIN_TIMESTAMP_CODE			102
 #define RR_SAMPLE_END_TIMESTAMP_CODE			103
 #define RR_ADAPT_SAMPLING_INTERVAL_CODE			104
+#define RR_CLOCK_CORRELATION_CODE				105
+#define RR_TIMESTAMP_FORMAT_CODE				106
+#define RR_CPU_ADAPT_SAMPLING_INTERVAL_CODE		107
+#define RR_MODULE_LOAD_CODE						108
+#define RR_MODULE_UNLOAD_CODE					109
+#define RR_SAMPLE_PERIOD_CODE					110
+#define RR_IDLE_CODE							111
+#define RR_EVENT_SET_CODE						112
+#define RR_COUNT_CODE							113
+#define RR_PERIOD_SCALE_CODE					114
+#define RR_CPU_PERIOD_SCALE_CODE				115
+#define RR_SAMPLE_DATA_CODE						116
+#define RR_BRANCH_STACK_CODE					117
+#define RR_SAMPLE_GROUP_CODE					118
 #endif // RRPROFILE
 
 struct super_block;
@@ -54,7 +68,29 @@ struct pt_regs;
 #ifdef RRPROFILE
 #define ADAPT_DECAY_FACTOR 10
 
+/* sampling periods are scaled by scale >> PERIOD_SCALE_SHIFT */
+#define PERIOD_SCALE_SHIFT 10
+#define PERIOD_SCALE_ONE (1UL << PERIOD_SCALE_SHIFT)
+
 struct rrprofile_tid_buffer;
+
+/* one taken branch of a sample's branch stack */
+struct op_branch {
+	uint64_t from;
+	uint64_t to;
+	unsigned long flags;
+};
+
+#define OP_BRANCH_MISPRED	(1UL << 0)
+#define OP_BRANCH_PREDICTED	(1UL << 1)
+/* core cycles since the branch before it, 0 if not known */
+#define OP_BRANCH_CYCLES_SHIFT	16
+
+/* what one counter counted since the last sample group on its cpu */
+struct op_group_value {
+	unsigned long counter;
+	uint64_t delta;
+};
 #endif // RRPROFILE
  
 /* Operations structure to be filled in */
@@ -83,10 +119,30 @@ struct oprofile_operations {
 #ifdef RRPROFILE
 	/* Adjust the sampling rate based on decay factor. Optional. */
 	int (*adapt)(void);
+	/* Largest period the counters or timer can be loaded with. With it
+	 * set each cpu can also be adapted on its own, see
+	 * oprofile_adapt_cpu(), and have its periods scaled by the
+	 * overhead_budget governor. Optional. */
+	unsigned long max_period;
 #endif // RRPROFILE
 	/* CPU identification string. */
 	char * cpu_type;
 #ifdef RRPROFILE
+	/* Rotate the next set of events onto the counters, called every
+	 * time_slice. Nonzero stops the rotation. Optional. */
+	int (*switch_events)(void);
+	/* Read the counting mode counters (enabled with a count of 0) of
+	 * this cpu, reporting what each counted since it was last read
+	 * through oprofile_add_count().
+	 * Called on the cpu with interrupts off. Optional. */
+	void (*read_counts)(void);
+	/* Called on every context switch while profiling, on the cpu
+	 * switching, with interrupts off. Optional. */
+	void (*sched_switch)(void);
+	/* Stop sampling on this cpu while no task of task_filter runs,
+	 * and go on where it stopped when one does again. Called with
+	 * interrupts off. Optional. */
+	void (*task_scope)(int on);
 	/* Number of Counters. */
 	unsigned int num_counters;
 #endif // RRPROFILE
@@ -210,6 +266,11 @@ void oprofile_cpu_buffer_inc_smpl_lost(void);
  **/
 uint64_t oprofile_get_tb(void);
 
+/**
+ * Get the frequency of the timestamp or timebase register in kHz.
+ **/
+unsigned long oprofile_get_tb_khz(void);
+
 /**
  * Called by each cpu to record start timestamp.
  */
@@ -230,6 +291,96 @@ void oprofile_add_sample_start(uint64_t timestamp);
  */
 void oprofile_add_sample_stop(uint64_t timestamp);
 
+/**
+ * Called by each cpu after it reloaded its counters or timer, to record
+ * when an interval changed by oprofile_adapt() or oprofile_adapt_cpu()
+ * took effect on this cpu, as the weight of its samples.
+ */
+void oprofile_add_adapt(void);
+
+/**
+ * Return the period to load for the next sample on this cpu: @mean
+ * times the cpu's own adapt weight, or a uniformly jittered value
+ * around it if sample_jitter is set.
+ */
+unsigned long oprofile_jitter_period(unsigned long mean);
+
+/**
+ * Called by to record the period that elapsed up to the next sample,
+ * when sampling intervals are jittered or follow a frequency.
+ */
+void oprofile_add_sample_period(unsigned long period);
+
+/**
+ * Called before the sample it belongs to, to record the data address,
+ * the latency in core cycles and the data source that the pmu reported
+ * along with a precise sample: the PEBS data source on Intel, IbsOpData3
+ * on AMD.
+ */
+void oprofile_add_sample_data(uint64_t addr, unsigned long latency,
+			      unsigned long source);
+
+/**
+ * Called before the sample it belongs to, to record the @nr most recent
+ * taken branches, most recent first.
+ */
+void oprofile_add_branch_stack(struct op_branch const *branches, int nr);
+
+/**
+ * Called before the sample it belongs to, to record the @nr raw IBS
+ * registers of an IBS fetch or op sample, with @code IBS_FETCH_CODE or
+ * IBS_OP_CODE.
+ */
+void oprofile_add_ibs_data(int code, uint64_t const *data, int nr);
+
+/**
+ * Called before the sample it belongs to, when sample_group is set, to
+ * record what each of @nr active counters counted since the last sample
+ * group on this cpu.
+ */
+void oprofile_add_sample_group(struct op_group_value const *values, int nr);
+
+/**
+ * Called at setup with nonzero if some counter samples at a frequency,
+ * so that every sample records its period.
+ */
+void oprofile_record_sample_periods(int on);
+
+/**
+ * Return the period to load next on this cpu for a counter sampling
+ * @freq times a second, whose last @period took @elapsed timebase ticks.
+ */
+unsigned long oprofile_freq_period(unsigned long period, uint64_t elapsed,
+				   unsigned long freq);
+
+/**
+ * Called by each cpu on leaving idle, when sampling was suspended while
+ * idle, to record the idle time as a single record.
+ */
+void oprofile_add_idle(uint64_t begin, uint64_t end);
+
+/**
+ * Called by each cpu after it switched the counters to another event
+ * set, to record which set is counting from now on.
+ */
+void oprofile_add_event_set(unsigned long set);
+
+/**
+ * Called from ->read_counts, or from the interrupt handler, to record
+ * what a counting mode counter counted since it was last read.
+ */
+void oprofile_add_count(unsigned long counter, uint64_t value);
+
+/**
+ * Called at the end of an interrupt handler that took samples, with the
+ * timestamp it was entered at, to account its time to the sampling
+ * overhead of this cpu.
+ */
+void oprofile_add_overhead(uint64_t begin);
+
+/** boolean for attaching counter deltas to every sample */
+extern unsigned long oprofile_sample_group;
+
 /** boolean for logging debug info */
 extern int rrprofile_debug;
 
@@ -29,6 +29,7 @@
 #ifdef RRPROFILE
 #include <linux/fs.h>
 #include <asm/prom.h>
+#include <asm/time.h>
 #include "oprofile_impl.h"
 #else
 #include <asm/oprofile_impl.h>
@@ -52,9 +53,23 @@ unsigned int cpu_khz = 0;
 
 static void op_handle_interrupt(struct pt_regs *regs)
 {
+#ifdef RRPROFILE
+	uint64_t begin = oprofile_get_tb();
+#endif // RRPROFILE
+
 	model->handle_interrupt(regs, ctr);
+#ifdef RRPROFILE
+	oprofile_add_overhead(begin);
+#endif // RRPROFILE
 }
 
+#ifdef RRPROFILE
+static void op_powerpc_read_counts(void)
+{
+	model->read_counts(ctr);
+}
+#endif // RRPROFILE
+
 static int op_powerpc_setup(void)
 {
 	int err;
@@ -241,6 +256,10 @@ int __init oprofile_arch_init(struct oprofile_operations *ops)
 	ops->start = op_powerpc_start;
 	ops->stop = op_powerpc_stop;
 	ops->backtrace = op_powerpc_backtrace;
+#ifdef RRPROFILE
+	if (model->read_counts)
+		ops->read_counts = op_powerpc_read_counts;
+#endif // RRPROFILE
 
 	printk(KERN_INFO "rrprofile: using %s performance monitoring.\n",
 	       ops->cpu_type);
@@ -290,5 +309,10 @@ uint64_t oprofile_get_tb()
 
 	return tb;
 }
+
+unsigned long oprofile_get_tb_khz(void)
+{
+	return ppc_tb_freq / 1000;
+}
 #endif // RRPROFILE
 
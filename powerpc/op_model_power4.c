@@ -561,6 +561,23 @@ static int get_kernel(unsigned long pc, unsigned long mmcra)
 	return is_kernel;
 }
 
+#ifdef RRPROFILE
+static void power4_read_counts(struct op_counter_config *ctr)
+{
+	unsigned int val;
+	int i;
+
+	for (i = 0; i < cur_cpu_spec->num_pmcs; ++i) {
+		if (!ctr[i].enabled || ctr[i].count)
+			continue;
+		val = ctr_read(i);
+		ctr_write(i, 0);
+		if (val)
+			oprofile_add_count(i, val);
+	}
+}
+#endif // RRPROFILE
+
 static void power4_handle_interrupt(struct pt_regs *regs,
 				    struct op_counter_config *ctr)
 {
@@ -588,11 +605,9 @@ static void power4_handle_interrupt(struct pt_regs *regs,
 		val = ctr_read(i);
 		if (oprofile_running && ctr[i].enabled) {
 			if(ctr[i].count == 0) {
-				// TODO: Add support for counter mode.
-				/* counter is in counter mode */
-				// Convert val to unsigned long
-				// add to cpu buffer
-				// reset counter to 0.
+				/* counter is in counter mode, report it
+				 * before it wraps */
+				oprofile_add_count(i, (unsigned int)val);
 				ctr_write(i, 0);
 			} else if (val < 0) {
 				/* counter is in trigger mode */
@@ -654,4 +669,7 @@ struct op_powerpc_model op_model_power4 = {
 	.start			= power4_start,
 	.stop			= power4_stop,
 	.handle_interrupt	= power4_handle_interrupt,
+#ifdef RRPROFILE
+	.read_counts		= power4_read_counts,
+#endif // RRPROFILE
 };
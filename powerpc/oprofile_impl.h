@@ -63,6 +63,10 @@ struct op_powerpc_model {
 	void (*stop) (void);
 	void (*handle_interrupt) (struct pt_regs *,
 				  struct op_counter_config *);
+#ifdef RRPROFILE
+	/* report and clear the counters in counter mode. Optional. */
+	void (*read_counts) (struct op_counter_config *);
+#endif // RRPROFILE
 	int num_counters;
 };
 
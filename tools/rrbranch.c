@@ -0,0 +1,298 @@
+/**
+ * @file rrbranch.c
+ * Convert the branch stacks of a saved stream to an AutoFDO profile
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * The default output is the unsymbolized text profile read by
+ * llvm-profgen and create_llvm_prof: the address ranges executed
+ * between consecutive branches, the sampled addresses and the taken
+ * branches, each section a count line followed by "key:count" lines.
+ * With -f perf every sample is printed as its ip and branch stack, as
+ * perf script -F ip,brstack does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rrstream.h"
+
+struct count {
+	uint64_t a;
+	uint64_t b;
+	unsigned long n;
+};
+
+/* counts keyed on an address pair, open addressing */
+struct table {
+	struct count *slots;
+	size_t size;
+	size_t used;
+};
+
+struct options {
+	int perf;
+	int kernel;
+	int has_tgid;
+	unsigned long tgid;
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+};
+
+struct profile {
+	struct options const *opts;
+	struct table ranges;
+	struct table addrs;
+	struct table branches;
+	unsigned long samples;
+};
+
+static size_t hash(uint64_t a, uint64_t b)
+{
+	uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ b * 0xc2b2ae3d27d4eb4fULL;
+
+	return h ^ h >> 29;
+}
+
+static struct count *lookup(struct count *slots, size_t size,
+			    uint64_t a, uint64_t b)
+{
+	size_t i = hash(a, b) & (size - 1);
+
+	while (slots[i].n && (slots[i].a != a || slots[i].b != b))
+		i = (i + 1) & (size - 1);
+	return &slots[i];
+}
+
+static void add(struct table *t, uint64_t a, uint64_t b)
+{
+	struct count *c, *slots;
+	size_t size, i;
+
+	if (2 * (t->used + 1) > t->size) {
+		size = t->size ? 2 * t->size : 1024;
+		slots = calloc(size, sizeof(*slots));
+		if (!slots) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < t->size; ++i) {
+			if (t->slots[i].n)
+				*lookup(slots, size, t->slots[i].a,
+					t->slots[i].b) = t->slots[i];
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->size = size;
+	}
+
+	c = lookup(t->slots, t->size, a, b);
+	if (!c->n) {
+		c->a = a;
+		c->b = b;
+		++t->used;
+	}
+	++c->n;
+}
+
+static int by_key(void const *l, void const *r)
+{
+	struct count const *cl = l, *cr = r;
+
+	if (cl->a != cr->a)
+		return cl->a < cr->a ? -1 : 1;
+	if (cl->b != cr->b)
+		return cl->b < cr->b ? -1 : 1;
+	return 0;
+}
+
+/* pack the used slots to the front, sorted so the output is stable */
+static void sort(struct table *t)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < t->size; ++i) {
+		if (t->slots[i].n)
+			t->slots[n++] = t->slots[i];
+	}
+	qsort(t->slots, n, sizeof(*t->slots), by_key);
+}
+
+static int keep(struct options const *opts, uint64_t addr)
+{
+	if (!opts->kernel && (addr >> 63 ||
+	    (sizeof(unsigned long) == 4 && addr >> 31)))
+		return 0;
+	if (opts->end && (addr < opts->start || addr >= opts->end))
+		return 0;
+	return 1;
+}
+
+static void print_perf(struct profile *p, struct rr_sample const *s)
+{
+	struct options const *opts = p->opts;
+	struct rr_branch const *br;
+	unsigned long cycles;
+	int i;
+
+	if (!keep(opts, s->pc))
+		return;
+	printf("%llx", (unsigned long long)(s->pc - opts->offset));
+	for (i = 0; i < s->nr_branches; ++i) {
+		br = &s->branches[i];
+		if (!keep(opts, br->from) || !keep(opts, br->to))
+			continue;
+		cycles = br->flags >> OP_BRANCH_CYCLES_SHIFT;
+		printf(" 0x%llx/0x%llx/%c/-/-/%lu",
+		       (unsigned long long)(br->from - opts->offset),
+		       (unsigned long long)(br->to - opts->offset),
+		       br->flags & OP_BRANCH_MISPRED ? 'M' :
+		       br->flags & OP_BRANCH_PREDICTED ? 'P' : '-',
+		       cycles);
+	}
+	printf("\n");
+}
+
+static void sample(struct rr_sample const *s, void *arg)
+{
+	struct profile *p = arg;
+	struct options const *opts = p->opts;
+	struct rr_branch const *br, *older;
+	int i;
+
+	if (!s->nr_branches)
+		return;
+	if (opts->has_tgid && s->tgid != opts->tgid)
+		return;
+
+	++p->samples;
+	if (opts->perf) {
+		print_perf(p, s);
+		return;
+	}
+
+	if (keep(opts, s->pc))
+		add(&p->addrs, s->pc - opts->offset, 0);
+
+	for (i = 0; i < s->nr_branches; ++i) {
+		br = &s->branches[i];
+		if (keep(opts, br->from) && keep(opts, br->to))
+			add(&p->branches, br->from - opts->offset,
+			    br->to - opts->offset);
+
+		/* straight line code from where the older branch landed
+		 * to where this one left */
+		if (i + 1 == s->nr_branches)
+			continue;
+		older = &s->branches[i + 1];
+		if (older->to <= br->from && keep(opts, older->to) &&
+		    keep(opts, br->from))
+			add(&p->ranges, older->to - opts->offset,
+			    br->from - opts->offset);
+	}
+}
+
+static void print_autofdo(struct profile *p)
+{
+	struct count const *c;
+	size_t i;
+
+	sort(&p->ranges);
+	printf("%zu\n", p->ranges.used);
+	for (i = 0; i < p->ranges.used; ++i) {
+		c = &p->ranges.slots[i];
+		printf("%llx-%llx:%lu\n", (unsigned long long)c->a,
+		       (unsigned long long)c->b, c->n);
+	}
+
+	sort(&p->addrs);
+	printf("%zu\n", p->addrs.used);
+	for (i = 0; i < p->addrs.used; ++i) {
+		c = &p->addrs.slots[i];
+		printf("%llx:%lu\n", (unsigned long long)c->a, c->n);
+	}
+
+	sort(&p->branches);
+	printf("%zu\n", p->branches.used);
+	for (i = 0; i < p->branches.used; ++i) {
+		c = &p->branches.slots[i];
+		printf("%llx->%llx:%lu\n", (unsigned long long)c->a,
+		       (unsigned long long)c->b, c->n);
+	}
+}
+
+static void usage(char const *name)
+{
+	fprintf(stderr,
+		"usage: %s [-k] [-p tgid] [-a start-end] [-o offset] "
+		"[-f autofdo|perf] stream...\n"
+		"  -k  keep kernel addresses\n"
+		"  -p  only samples of this process\n"
+		"  -a  only branches within [start, end)\n"
+		"  -o  subtract offset from every address\n"
+		"  -f  output format, autofdo by default\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opts;
+	struct profile p;
+	char *end;
+	int opt;
+
+	memset(&opts, 0, sizeof(opts));
+	while ((opt = getopt(argc, argv, "kp:a:o:f:")) != -1) {
+		switch (opt) {
+		case 'k':
+			opts.kernel = 1;
+			break;
+		case 'p':
+			opts.tgid = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(argv[0]);
+			opts.has_tgid = 1;
+			break;
+		case 'a':
+			opts.start = strtoull(optarg, &end, 16);
+			if (*end != '-')
+				usage(argv[0]);
+			opts.end = strtoull(end + 1, &end, 16);
+			if (*end || opts.end <= opts.start)
+				usage(argv[0]);
+			break;
+		case 'o':
+			opts.offset = strtoull(optarg, &end, 16);
+			if (*end)
+				usage(argv[0]);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "perf"))
+				opts.perf = 1;
+			else if (strcmp(optarg, "autofdo"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	memset(&p, 0, sizeof(p));
+	p.opts = &opts;
+	for (; optind < argc; ++optind) {
+		if (rr_stream_read(argv[optind], sample, &p))
+			return EXIT_FAILURE;
+	}
+
+	if (!p.samples)
+		fprintf(stderr, "no samples with a branch stack\n");
+	if (!opts.perf)
+		print_autofdo(&p);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,383 @@
+/**
+ * @file rrcacheline.c
+ * Find contended cache lines in the data samples of a saved stream
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * The data addresses of PEBS load latency or IBS op samples are grouped
+ * by cache line. A line touched by more than one thread or cpu is
+ * reported with its samples, the HITM (Intel) or data cache miss (AMD)
+ * count, the load latency and the hottest pc. It is false sharing when
+ * the threads touch disjoint offsets in it, true sharing when they
+ * touch the same ones. Lines whose mean latency reaches the threshold
+ * are flagged with a '*'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rrstream.h"
+
+#define MAX_LINE_SIZE	512
+#define MASK_WORDS	(MAX_LINE_SIZE / 64)
+
+/* Intel PEBS data source, low nibble: L3 hit and remote cache HITM */
+#define DSE_LOCAL_HITM	0x7
+#define DSE_REMOTE_HITM	0xd
+
+/* AMD IbsOpData3 */
+#define IBS_OP_LD	(1UL << 0)
+#define IBS_OP_ST	(1UL << 1)
+#define IBS_OP_DC_MISS	(1UL << 7)
+
+enum { SOURCE_INTEL, SOURCE_AMD };
+
+/* the offsets one thread touched in a line */
+struct thread {
+	unsigned long tid;
+	uint64_t mask[MASK_WORDS];
+};
+
+struct pc_count {
+	unsigned long pc;
+	unsigned long n;
+};
+
+struct line {
+	uint64_t addr;
+	unsigned long samples;
+	unsigned long hitm;
+	unsigned long stores;
+	unsigned long long latency;
+	unsigned long max_latency;
+	int nr_threads;
+	struct thread *threads;
+	int nr_cpus;
+	int *cpus;
+	int nr_pcs;
+	struct pc_count *pcs;
+	/* filled in by classify() */
+	int flagged;
+	int false_sharing;
+	unsigned long top_pc;
+};
+
+struct options {
+	int source;
+	int has_tgid;
+	unsigned long tgid;
+	unsigned long line_size;
+	unsigned long threshold;
+};
+
+struct analysis {
+	struct options const *opts;
+	struct line *lines;
+	size_t size;
+	size_t used;
+	unsigned long samples;
+};
+
+static void *grow(void *p, size_t nr, size_t size)
+{
+	p = realloc(p, nr * size);
+	if (!p) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static struct line *lookup(struct line *lines, size_t size, uint64_t addr)
+{
+	uint64_t h = addr * 0x9e3779b97f4a7c15ULL;
+	size_t i = (h ^ h >> 29) & (size - 1);
+
+	while (lines[i].samples && lines[i].addr != addr)
+		i = (i + 1) & (size - 1);
+	return &lines[i];
+}
+
+static struct line *get_line(struct analysis *a, uint64_t addr)
+{
+	struct line *lines;
+	size_t size, i;
+
+	if (2 * (a->used + 1) > a->size) {
+		size = a->size ? 2 * a->size : 1024;
+		lines = calloc(size, sizeof(*lines));
+		if (!lines) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < a->size; ++i) {
+			if (a->lines[i].samples)
+				*lookup(lines, size, a->lines[i].addr) =
+					a->lines[i];
+		}
+		free(a->lines);
+		a->lines = lines;
+		a->size = size;
+	}
+	return lookup(a->lines, a->size, addr);
+}
+
+static struct thread *get_thread(struct line *l, unsigned long tid)
+{
+	int i;
+
+	for (i = 0; i < l->nr_threads; ++i) {
+		if (l->threads[i].tid == tid)
+			return &l->threads[i];
+	}
+	l->threads = grow(l->threads, l->nr_threads + 1, sizeof(*l->threads));
+	memset(&l->threads[i], 0, sizeof(l->threads[i]));
+	l->threads[i].tid = tid;
+	++l->nr_threads;
+	return &l->threads[i];
+}
+
+static void add_cpu(struct line *l, int cpu)
+{
+	int i;
+
+	for (i = 0; i < l->nr_cpus; ++i) {
+		if (l->cpus[i] == cpu)
+			return;
+	}
+	l->cpus = grow(l->cpus, l->nr_cpus + 1, sizeof(*l->cpus));
+	l->cpus[l->nr_cpus++] = cpu;
+}
+
+static void add_pc(struct line *l, unsigned long pc)
+{
+	int i;
+
+	for (i = 0; i < l->nr_pcs; ++i) {
+		if (l->pcs[i].pc == pc) {
+			++l->pcs[i].n;
+			return;
+		}
+	}
+	l->pcs = grow(l->pcs, l->nr_pcs + 1, sizeof(*l->pcs));
+	l->pcs[l->nr_pcs].pc = pc;
+	l->pcs[l->nr_pcs].n = 1;
+	++l->nr_pcs;
+}
+
+static int is_hitm(struct options const *opts, unsigned long source)
+{
+	if (opts->source == SOURCE_AMD)
+		return !!(source & IBS_OP_DC_MISS);
+	return (source & 0xf) == DSE_LOCAL_HITM ||
+	       (source & 0xf) == DSE_REMOTE_HITM;
+}
+
+static void sample(struct rr_sample const *s, void *arg)
+{
+	struct analysis *a = arg;
+	struct options const *opts = a->opts;
+	struct thread *t;
+	struct line *l;
+	uint64_t addr;
+	unsigned long off;
+
+	if (!s->has_data || !s->data_addr)
+		return;
+	if (opts->has_tgid && s->tgid != opts->tgid)
+		return;
+
+	addr = s->data_addr & ~(uint64_t)(opts->line_size - 1);
+	off = s->data_addr & (opts->line_size - 1);
+	l = get_line(a, addr);
+	if (!l->samples) {
+		l->addr = addr;
+		++a->used;
+	}
+
+	++a->samples;
+	++l->samples;
+	l->latency += s->data_latency;
+	if (s->data_latency > l->max_latency)
+		l->max_latency = s->data_latency;
+	if (is_hitm(opts, s->data_source))
+		++l->hitm;
+	if (opts->source == SOURCE_AMD && (s->data_source & IBS_OP_ST))
+		++l->stores;
+
+	t = get_thread(l, s->tid);
+	t->mask[off / 64] |= 1ULL << (off % 64);
+	add_cpu(l, s->cpu);
+	add_pc(l, s->pc);
+}
+
+/* false sharing when no offset was touched by two threads */
+static void classify(struct options const *opts, struct line *l)
+{
+	uint64_t seen[MASK_WORDS], shared = 0;
+	int i, j;
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < l->nr_threads; ++i) {
+		for (j = 0; j < MASK_WORDS; ++j) {
+			shared |= seen[j] & l->threads[i].mask[j];
+			seen[j] |= l->threads[i].mask[j];
+		}
+	}
+	l->false_sharing = l->nr_threads > 1 && !shared;
+	l->flagged = l->latency / l->samples >= opts->threshold;
+
+	l->top_pc = l->pcs[0].pc;
+	for (i = 1, j = 0; i < l->nr_pcs; ++i) {
+		if (l->pcs[i].n > l->pcs[j].n) {
+			j = i;
+			l->top_pc = l->pcs[i].pc;
+		}
+	}
+}
+
+static unsigned long long score(struct line const *l)
+{
+	int n = l->nr_threads > l->nr_cpus ? l->nr_threads : l->nr_cpus;
+
+	return l->latency * n;
+}
+
+static int by_score(void const *left, void const *right)
+{
+	struct line const *l = left, *r = right;
+	unsigned long long sl = score(l), sr = score(r);
+
+	if (sl != sr)
+		return sl > sr ? -1 : 1;
+	return l->addr < r->addr ? -1 : l->addr > r->addr;
+}
+
+static void print_offsets(struct options const *opts, struct thread const *t)
+{
+	unsigned long off;
+	char const *sep = "";
+
+	printf("    tid %-8lu", t->tid);
+	for (off = 0; off < opts->line_size; ++off) {
+		if (t->mask[off / 64] & (1ULL << (off % 64))) {
+			printf("%s+%lu", sep, off);
+			sep = ",";
+		}
+	}
+	printf("\n");
+}
+
+static void report(struct analysis *a)
+{
+	struct options const *opts = a->opts;
+	struct line *l;
+	size_t i, n = 0;
+	int j;
+
+	/* keep only the lines more than one thread or cpu touched */
+	for (i = 0; i < a->size; ++i) {
+		l = &a->lines[i];
+		if (l->samples && (l->nr_threads > 1 || l->nr_cpus > 1)) {
+			classify(opts, l);
+			a->lines[n++] = *l;
+		} else if (l->samples) {
+			free(l->threads);
+			free(l->cpus);
+			free(l->pcs);
+		}
+	}
+	qsort(a->lines, n, sizeof(*a->lines), by_score);
+
+	printf("%lu data samples, %zu lines, %zu shared\n\n",
+	       a->samples, a->used, n);
+	if (!n)
+		return;
+
+	printf("  %-18s %8s %8s %7s %4s %8s %8s %-5s %s\n", "line", "samples",
+	       opts->source == SOURCE_AMD ? "dcmiss" : "hitm", "threads",
+	       "cpus", "lat", "maxlat", "share", "top pc");
+	for (i = 0; i < n; ++i) {
+		l = &a->lines[i];
+		printf("%c 0x%-16llx %8lu %8lu %7d %4d %8llu %8lu %-5s 0x%lx\n",
+		       l->flagged ? '*' : ' ', (unsigned long long)l->addr,
+		       l->samples, l->hitm, l->nr_threads, l->nr_cpus,
+		       l->latency / l->samples, l->max_latency,
+		       l->nr_threads < 2 ? "-" :
+		       l->false_sharing ? "false" : "true", l->top_pc);
+		if (opts->source == SOURCE_AMD && l->stores)
+			printf("    %lu stores\n", l->stores);
+		for (j = 0; j < l->nr_threads; ++j)
+			print_offsets(opts, &l->threads[j]);
+	}
+}
+
+static void usage(char const *name)
+{
+	fprintf(stderr,
+		"usage: %s [-p tgid] [-l line size] [-t latency] "
+		"[-s intel|amd] stream...\n"
+		"  -p  only samples of this process\n"
+		"  -l  cache line size in bytes, 64 by default\n"
+		"  -t  flag lines whose mean latency reaches this many "
+		"cycles, 100\n"
+		"  -s  data source encoding, intel by default\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opts;
+	struct analysis a;
+	char *end;
+	int opt;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.line_size = 64;
+	opts.threshold = 100;
+	while ((opt = getopt(argc, argv, "p:l:t:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			opts.tgid = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(argv[0]);
+			opts.has_tgid = 1;
+			break;
+		case 'l':
+			opts.line_size = strtoul(optarg, &end, 0);
+			if (*end || !opts.line_size ||
+			    opts.line_size > MAX_LINE_SIZE ||
+			    (opts.line_size & (opts.line_size - 1)))
+				usage(argv[0]);
+			break;
+		case 't':
+			opts.threshold = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (!strcmp(optarg, "amd"))
+				opts.source = SOURCE_AMD;
+			else if (strcmp(optarg, "intel"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	memset(&a, 0, sizeof(a));
+	a.opts = &opts;
+	for (; optind < argc; ++optind) {
+		if (rr_stream_read(argv[optind], sample, &a))
+			return EXIT_FAILURE;
+	}
+
+	report(&a);
+	return EXIT_SUCCESS;
+}
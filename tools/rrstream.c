@@ -0,0 +1,335 @@
+/**
+ * @file rrstream.c
+ * Decoding of the rrprofile event buffer stream
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rrstream.h"
+
+/* Each cpu's records come in order, but with the merged stream the
+ * cpus interleave, so what a sample picks up is kept per cpu. */
+struct cpu_state {
+	unsigned long tgid;
+	unsigned long tid;
+	int in_kernel;
+	/* 1 after TRACE_BEGIN, 2 once its sample is seen */
+	int in_trace;
+	unsigned long period;
+	int has_data;
+	uint64_t data_addr;
+	unsigned long data_latency;
+	unsigned long data_source;
+	int nr_branches;
+	int max_branches;
+	struct rr_branch *branches;
+};
+
+struct stream {
+	char const *path;
+	unsigned long const *words;
+	size_t nr;
+	size_t pos;
+	struct cpu_state *cpus;
+	int nr_cpus;
+};
+
+static int truncated(struct stream *s)
+{
+	fprintf(stderr, "%s: stream ends inside a record at word %zu\n",
+		s->path, s->pos);
+	return -1;
+}
+
+static int get_word(struct stream *s, unsigned long *val)
+{
+	if (s->pos >= s->nr)
+		return truncated(s);
+	*val = s->words[s->pos++];
+	return 0;
+}
+
+/* 64-bit values take two words on 32-bit kernels, high word first */
+static int get_u64(struct stream *s, uint64_t *val)
+{
+	unsigned long hi, lo;
+
+	if (sizeof(unsigned long) == 8) {
+		if (get_word(s, &lo))
+			return -1;
+		*val = lo;
+		return 0;
+	}
+	if (get_word(s, &hi) || get_word(s, &lo))
+		return -1;
+	*val = (uint64_t)hi << 32 | lo;
+	return 0;
+}
+
+static int skip(struct stream *s, size_t words)
+{
+	if (s->nr - s->pos < words)
+		return truncated(s);
+	s->pos += words;
+	return 0;
+}
+
+static int skip_u64(struct stream *s, size_t nr)
+{
+	return skip(s, nr * (sizeof(uint64_t) / sizeof(unsigned long)));
+}
+
+static struct cpu_state *get_cpu(struct stream *s, unsigned long cpu)
+{
+	struct cpu_state *cpus;
+	int nr;
+
+	if (cpu < (unsigned long)s->nr_cpus)
+		return &s->cpus[cpu];
+
+	if (cpu >= 65536) {
+		fprintf(stderr, "%s: bad cpu %lu at word %zu\n",
+			s->path, cpu, s->pos);
+		return NULL;
+	}
+	nr = cpu + 1;
+	cpus = realloc(s->cpus, nr * sizeof(*cpus));
+	if (!cpus) {
+		perror("realloc");
+		return NULL;
+	}
+	memset(cpus + s->nr_cpus, 0, (nr - s->nr_cpus) * sizeof(*cpus));
+	s->cpus = cpus;
+	s->nr_cpus = nr;
+	return &s->cpus[cpu];
+}
+
+static int read_branches(struct stream *s, struct cpu_state *st)
+{
+	struct rr_branch *br;
+	unsigned long nr;
+	unsigned long i;
+
+	if (get_word(s, &nr))
+		return -1;
+	if (nr > (s->nr - s->pos))
+		return truncated(s);
+
+	if ((int)nr > st->max_branches) {
+		br = realloc(st->branches, nr * sizeof(*br));
+		if (!br) {
+			perror("realloc");
+			return -1;
+		}
+		st->branches = br;
+		st->max_branches = nr;
+	}
+
+	for (i = 0; i < nr; ++i) {
+		br = &st->branches[i];
+		if (get_u64(s, &br->from) || get_u64(s, &br->to) ||
+		    get_word(s, &br->flags))
+			return -1;
+	}
+	st->nr_branches = nr;
+	return 0;
+}
+
+/* the record after ESCAPE_CODE, for the cpu whose records these are */
+static int read_record(struct stream *s, int *cpu)
+{
+	struct cpu_state *st = get_cpu(s, *cpu);
+	unsigned long code, val;
+	uint64_t addr;
+
+	if (!st || get_word(s, &code))
+		return -1;
+
+	/* any record ends a call chain */
+	if (st->in_trace == 2)
+		st->in_trace = 0;
+
+	switch (code) {
+	case CTX_SWITCH_CODE:
+		return get_word(s, &st->tid) || get_word(s, &st->tgid);
+	case CPU_SWITCH_CODE:
+		if (get_word(s, &val) || !get_cpu(s, val))
+			return -1;
+		*cpu = val;
+		return 0;
+	case COOKIE_SWITCH_CODE:
+		return skip(s, 1);
+	case CTX_TGID_CODE:
+		return get_word(s, &st->tgid);
+	case KERNEL_ENTER_SWITCH_CODE:
+		st->in_kernel = 1;
+		return 0;
+	case KERNEL_EXIT_SWITCH_CODE:
+		st->in_kernel = 0;
+		return 0;
+	case TRACE_BEGIN_CODE:
+		/* the next pair is the sample, those after it up to the
+		 * next record are its call chain */
+		st->in_trace = 1;
+		return 0;
+	case MODULE_LOADED_CODE:
+	case TRACE_END_CODE:
+		return 0;
+	case IBS_FETCH_CODE:
+	case IBS_OP_CODE:
+		if (get_word(s, &val))
+			return -1;
+		return skip_u64(s, val);
+	case RR_CPU_SAMPLING_BEGIN_TIMESTAMP_CODE:
+	case RR_CPU_SAMPLING_END_TIMESTAMP_CODE:
+	case RR_SAMPLE_BEGIN_TIMESTAMP_CODE:
+	case RR_SAMPLE_END_TIMESTAMP_CODE:
+		return skip_u64(s, 1);
+	case RR_ADAPT_SAMPLING_INTERVAL_CODE:
+	case RR_TIMESTAMP_FORMAT_CODE:
+		return skip(s, 1);
+	case RR_CLOCK_CORRELATION_CODE:
+		return skip(s, 1) || skip_u64(s, 3);
+	case RR_CPU_ADAPT_SAMPLING_INTERVAL_CODE:
+	case RR_CPU_PERIOD_SCALE_CODE:
+	case RR_EVENT_SET_CODE:
+		return skip(s, 1) || skip_u64(s, 1);
+	case RR_MODULE_LOAD_CODE:
+	case RR_MODULE_UNLOAD_CODE:
+		/* base, size, time, then the name NUL padded to words */
+		if (skip(s, 2) || skip_u64(s, 1) || get_word(s, &val))
+			return -1;
+		return skip(s, (val + sizeof(unsigned long) - 1) /
+			    sizeof(unsigned long));
+	case RR_SAMPLE_PERIOD_CODE:
+		return get_word(s, &st->period);
+	case RR_IDLE_CODE:
+		return skip_u64(s, 2);
+	case RR_COUNT_CODE:
+		return skip(s, 1) || skip_u64(s, 2);
+	case RR_PERIOD_SCALE_CODE:
+		return skip(s, 2);
+	case RR_SAMPLE_DATA_CODE:
+		if (get_u64(s, &addr) || get_word(s, &st->data_latency) ||
+		    get_word(s, &st->data_source))
+			return -1;
+		st->data_addr = addr;
+		st->has_data = 1;
+		return 0;
+	case RR_BRANCH_STACK_CODE:
+		return read_branches(s, st);
+	case RR_SAMPLE_GROUP_CODE:
+		if (get_word(s, &val))
+			return -1;
+		if (val > s->nr - s->pos)
+			return truncated(s);
+		while (val--) {
+			if (skip(s, 1) || skip_u64(s, 1))
+				return -1;
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "%s: unknown record %lu at word %zu\n",
+		s->path, code, s->pos - 1);
+	return -1;
+}
+
+static int decode(struct stream *s, rr_sample_fn fn, void *arg)
+{
+	struct rr_sample sample;
+	struct cpu_state *st;
+	unsigned long word;
+	int cpu = 0;
+
+	while (s->pos < s->nr) {
+		word = s->words[s->pos++];
+		if (word == ESCAPE_CODE) {
+			if (read_record(s, &cpu))
+				return -1;
+			continue;
+		}
+
+		st = get_cpu(s, cpu);
+		if (!st)
+			return -1;
+		memset(&sample, 0, sizeof(sample));
+		sample.pc = word;
+		if (get_word(s, &sample.event))
+			return -1;
+		if (st->in_trace == 2)
+			continue;
+		if (st->in_trace)
+			st->in_trace = 2;
+
+		sample.cpu = cpu;
+		sample.tgid = st->tgid;
+		sample.tid = st->tid;
+		sample.in_kernel = st->in_kernel;
+		sample.period = st->period;
+		sample.has_data = st->has_data;
+		sample.data_addr = st->data_addr;
+		sample.data_latency = st->data_latency;
+		sample.data_source = st->data_source;
+		sample.nr_branches = st->nr_branches;
+		sample.branches = st->branches;
+		fn(&sample, arg);
+
+		/* these belong to this sample only */
+		st->period = 0;
+		st->has_data = 0;
+		st->nr_branches = 0;
+	}
+	return 0;
+}
+
+int rr_stream_read(char const *path, rr_sample_fn fn, void *arg)
+{
+	struct stream s;
+	struct stat sb;
+	void *map;
+	int fd, ret, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (sb.st_size % sizeof(unsigned long))
+		fprintf(stderr, "%s: ignoring a partial word at the end\n", path);
+	if (sb.st_size < (off_t)sizeof(unsigned long)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.path = path;
+	s.words = map;
+	s.nr = sb.st_size / sizeof(unsigned long);
+	ret = decode(&s, fn, arg);
+
+	for (i = 0; i < s.nr_cpus; ++i)
+		free(s.cpus[i].branches);
+	free(s.cpus);
+	munmap(map, sb.st_size);
+	return ret;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file rrstream.h
+ * Decoding of the rrprofile event buffer stream
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * The stream is what reads of /dev/rrprofile/buffer return, saved to a
+ * file: native unsigned longs written by a kernel of the same word size
+ * and byte order as the tools. Every sample is delivered with the
+ * records the kernel wrote for it, see rr_sync_entry() in
+ * driver/buffer_sync.c for the layout of each record.
+ */
+
+#ifndef RRSTREAM_H
+#define RRSTREAM_H
+
+#include <stdint.h>
+
+/* escape codes, as in ../oprofile.h */
+#define ESCAPE_CODE			~0UL
+#define CTX_SWITCH_CODE			1
+#define CPU_SWITCH_CODE			2
+#define COOKIE_SWITCH_CODE		3
+#define KERNEL_ENTER_SWITCH_CODE	4
+#define KERNEL_EXIT_SWITCH_CODE		5
+#define MODULE_LOADED_CODE		6
+#define CTX_TGID_CODE			7
+#define TRACE_BEGIN_CODE		8
+#define TRACE_END_CODE			9
+#define IBS_FETCH_CODE			13
+#define IBS_OP_CODE			14
+#define RR_CPU_SAMPLING_BEGIN_TIMESTAMP_CODE	100
+#define RR_CPU_SAMPLING_END_TIMESTAMP_CODE		101
+#define RR_SAMPLE_BEGIN_TIMESTAMP_CODE			102
+#define RR_SAMPLE_END_TIMESTAMP_CODE			103
+#define RR_ADAPT_SAMPLING_INTERVAL_CODE			104
+#define RR_CLOCK_CORRELATION_CODE				105
+#define RR_TIMESTAMP_FORMAT_CODE				106
+#define RR_CPU_ADAPT_SAMPLING_INTERVAL_CODE		107
+#define RR_MODULE_LOAD_CODE						108
+#define RR_MODULE_UNLOAD_CODE					109
+#define RR_SAMPLE_PERIOD_CODE					110
+#define RR_IDLE_CODE							111
+#define RR_EVENT_SET_CODE						112
+#define RR_COUNT_CODE							113
+#define RR_PERIOD_SCALE_CODE					114
+#define RR_CPU_PERIOD_SCALE_CODE				115
+#define RR_SAMPLE_DATA_CODE						116
+#define RR_BRANCH_STACK_CODE					117
+#define RR_SAMPLE_GROUP_CODE					118
+
+/* branch flags, as struct op_branch in ../oprofile.h */
+#define OP_BRANCH_MISPRED	(1UL << 0)
+#define OP_BRANCH_PREDICTED	(1UL << 1)
+#define OP_BRANCH_CYCLES_SHIFT	16
+
+struct rr_branch {
+	uint64_t from;
+	uint64_t to;
+	unsigned long flags;
+};
+
+/* one sample and the records that came with it */
+struct rr_sample {
+	int cpu;
+	unsigned long tgid;
+	unsigned long tid;
+	int in_kernel;
+	unsigned long pc;
+	/* counter number or OP_IBS_*_EVENT */
+	unsigned long event;
+	/* 0 unless periods are recorded */
+	unsigned long period;
+	/* data address, latency and source of memory samples */
+	int has_data;
+	uint64_t data_addr;
+	unsigned long data_latency;
+	unsigned long data_source;
+	/* the branch stack, most recent branch first */
+	int nr_branches;
+	struct rr_branch const *branches;
+};
+
+typedef void (*rr_sample_fn)(struct rr_sample const *sample, void *arg);
+
+/* Decode the stream saved in @path and call @fn for each sample. Zero
+ * on success, -1 after printing why to stderr. */
+int rr_stream_read(char const *path, rr_sample_fn fn, void *arg);
+
+#endif /* RRSTREAM_H */
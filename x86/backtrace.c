@@ -18,6 +18,9 @@
 #include <linux/mm.h>
 #include <asm/ptrace.h>
 #include <asm/uaccess.h>
+#ifdef RRPROFILE
+#include "op_x86_model.h"
+#endif // RRPROFILE
 
 struct frame_head {
 	struct frame_head * ebp;
@@ -265,6 +268,10 @@ x86_backtrace(struct pt_regs * const regs, unsigned int depth)
 	}
 	
 #ifdef RRPROFILE
+	/* without frame pointers, the LBR call stack is the only way up */
+	if (op_lbr_backtrace(regs, depth))
+		return;
+
 #ifdef CONFIG_X86_64
 	if (!test_thread_flag(TIF_IA32)) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
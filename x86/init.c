@@ -15,6 +15,10 @@
 #endif // RRPROFILE
 #include <linux/init.h>
 #include <linux/errno.h>
+#ifdef RRPROFILE
+#include <linux/version.h>
+#include <asm/timex.h>
+#endif // RRPROFILE
  
 /* We support CPUs that have performance counters like the Pentium Pro
  * with the NMI mode driver.
@@ -71,4 +75,13 @@ uint64_t oprofile_get_tb(void) {
 
 	return result;
 }
+
+unsigned long oprofile_get_tb_khz(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	if (tsc_khz)
+		return tsc_khz;
+#endif
+	return cpu_khz;
+}
 #endif // RRPROFILE
@@ -55,9 +55,24 @@ static int ctr_running;
 static int nmi_start(void);
 static void nmi_stop(void);
 
+#ifdef RRPROFILE
+/* pmcN directories, more than num_counters if the model multiplexes */
+static unsigned int num_virt_counters;
+#endif // RRPROFILE
+
 /* 0 == registered but off, 1 == registered and on */
 static int nmi_enabled = 0;
 
+#ifdef RRPROFILE
+/* counters stopped while no task of the task_filter runs */
+static DEFINE_PER_CPU(int, nmi_task_off);
+
+int op_x86_task_off(void)
+{
+	return per_cpu(nmi_task_off, smp_processor_id());
+}
+#endif // RRPROFILE
+
 #ifdef CONFIG_PM
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
@@ -143,13 +158,27 @@ static void exit_driverfs(void)
 #define exit_driverfs() do { } while (0)
 #endif /* CONFIG_PM */
 
+#ifdef RRPROFILE
+/* the handler time is accounted as sampling overhead */
+static int nmi_check_ctrs(struct pt_regs *regs, int cpu)
+{
+	uint64_t begin = oprofile_get_tb();
+	int ret = model->check_ctrs(regs, &cpu_msrs[cpu]);
+
+	oprofile_add_overhead(begin);
+	return ret;
+}
+#else
+#define nmi_check_ctrs(regs, cpu) model->check_ctrs(regs, &cpu_msrs[cpu])
+#endif // RRPROFILE
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
 static int profile_exceptions_notify(unsigned int val, struct pt_regs *regs)
 {
 	int cpu = smp_processor_id();
 
 	if (ctr_running)
-		model->check_ctrs(regs, &cpu_msrs[cpu]);
+		return nmi_check_ctrs(regs, cpu) ? NMI_HANDLED : NMI_DONE;
 	else if (!nmi_enabled)
 		return NMI_DONE;
 	else
@@ -166,7 +195,7 @@ static int profile_exceptions_notify(struct notifier_block *self,
 
 	switch(val) {
 	case DIE_NMI:
-		if (model->check_ctrs(args->regs, &cpu_msrs[cpu]))
+		if (nmi_check_ctrs(args->regs, cpu))
 			ret = NOTIFY_STOP;
 		break;
 	default:
@@ -177,7 +206,7 @@ static int profile_exceptions_notify(struct notifier_block *self,
 #else
 static int nmi_callback(struct pt_regs * regs, int cpu)
 {
-	return model->check_ctrs(regs, &cpu_msrs[cpu]);
+	return nmi_check_ctrs(regs, cpu);
 }
 #endif
  
@@ -229,6 +258,10 @@ static void free_msrs(void)
 		cpu_msrs[i].counters = NULL;
 		kfree(cpu_msrs[i].controls);
 		cpu_msrs[i].controls = NULL;
+#ifdef RRPROFILE
+		kfree(cpu_msrs[i].multiplex);
+		cpu_msrs[i].multiplex = NULL;
+#endif // RRPROFILE
 	}
 }
 
@@ -255,6 +288,16 @@ static int allocate_msrs(void)
 			success = 0;
 			break;
 		}
+#ifdef RRPROFILE
+		if (!model->switch_ctrl)
+			continue;
+		cpu_msrs[i].multiplex = kmalloc(sizeof(struct op_msr) *
+						num_virt_counters, GFP_KERNEL);
+		if (!cpu_msrs[i].multiplex) {
+			success = 0;
+			break;
+		}
+#endif // RRPROFILE
 	}
 
 	if (!success)
@@ -263,11 +306,217 @@ static int allocate_msrs(void)
 	return success;
 }
 
+#ifdef RRPROFILE
+/*
+ * Event multiplexing. The first model->num_mpx_counters counters rotate
+ * through event sets, one set per time_slice: set 0 is pmc0 up to
+ * pmc<num_counters - 1>, set k > 0 puts pmcN with
+ * N = num_counters + (k - 1) * num_mpx_counters + i on counter i.
+ * The remaining (fixed function) counters keep their event throughout.
+ */
+static DEFINE_PER_CPU(int, event_set);
+static int num_event_sets = 1;
+static DEFINE_PER_CPU(uint64_t, cpu_start_tb);
+static DEFINE_PER_CPU(uint64_t, set_start_tb);
+static uint64_t set_running_tb[OP_MAX_COUNTER];
+static uint64_t enabled_tb;
+static DEFINE_SPINLOCK(mpx_lock);
+
+int op_x86_phys_to_virt(int phys)
+{
+	int set = per_cpu(event_set, smp_processor_id());
+
+	if (!set || phys >= model->num_mpx_counters)
+		return phys;
+	return model->num_counters + (set - 1) * model->num_mpx_counters + phys;
+}
+
+/* the event set pmcN belongs to, -1 for counters that never rotate */
+static int virt_to_set(int virt)
+{
+	if (virt >= model->num_counters)
+		return 1 + (virt - model->num_counters) / model->num_mpx_counters;
+	return virt < model->num_mpx_counters ? 0 : -1;
+}
+
+static int nmi_count_event_sets(void)
+{
+	int i, sets = 1;
+
+	if (!model->switch_ctrl)
+		return 1;
+
+	for (i = model->num_counters; i < num_virt_counters; ++i) {
+		if (counter_config[i].enabled && virt_to_set(i) + 1 > sets)
+			sets = virt_to_set(i) + 1;
+	}
+	return sets;
+}
+
+static void nmi_cpu_setup_mpx(struct op_msrs * msrs)
+{
+	int i;
+
+	per_cpu(event_set, smp_processor_id()) = 0;
+	if (!msrs->multiplex)
+		return;
+
+	/* counters of the later sets start a full period away */
+	for (i = 0; i < num_virt_counters; ++i) {
+		/* counting mode counters start from 0 */
+		if (!counter_config[i].count) {
+			msrs->multiplex[i].period = 0;
+			msrs->multiplex[i].saved.low = 0;
+			msrs->multiplex[i].saved.high = 0;
+			continue;
+		}
+		msrs->multiplex[i].period =
+			oprofile_jitter_period(counter_config[i].count);
+		msrs->multiplex[i].saved.low = -(u32)msrs->multiplex[i].period;
+		msrs->multiplex[i].saved.high = -1;
+		msrs->multiplex[i].loaded_tb = 0;
+	}
+}
+
+/* nonzero if an enabled counter samples at a frequency */
+static int nmi_any_freq(void)
+{
+	int i;
+
+	for (i = 0; i < num_virt_counters; ++i) {
+		if (counter_config[i].enabled && counter_config[i].freq &&
+		    counter_config[i].count)
+			return 1;
+	}
+	return 0;
+}
+
+static void nmi_cpu_save_mpx_registers(struct op_msrs * msrs)
+{
+	struct op_msr * multiplex = msrs->multiplex;
+	uint64_t now = oprofile_get_tb();
+	int i, virt;
+
+	for (i = 0; i < model->num_mpx_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled)
+			continue;
+		rdmsr(msrs->counters[i].addr, multiplex[virt].saved.low,
+		      multiplex[virt].saved.high);
+		multiplex[virt].period = msrs->counters[i].period;
+		/* keep the time the period ran so far */
+		multiplex[virt].loaded_tb = now - msrs->counters[i].loaded_tb;
+	}
+}
+
+static void nmi_cpu_restore_mpx_registers(struct op_msrs * msrs)
+{
+	struct op_msr * multiplex = msrs->multiplex;
+	uint64_t now = oprofile_get_tb();
+	int i, virt;
+
+	for (i = 0; i < model->num_mpx_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled)
+			continue;
+		wrmsr(msrs->counters[i].addr, multiplex[virt].saved.low,
+		      multiplex[virt].saved.high);
+		msrs->counters[i].period = multiplex[virt].period;
+		msrs->counters[i].loaded_tb = now - multiplex[virt].loaded_tb;
+	}
+}
+
+/* charge the time since the last switch to the set leaving the counters */
+static void nmi_account_event_set(int cpu, uint64_t now)
+{
+	uint64_t *start = &per_cpu(set_start_tb, cpu);
+
+	spin_lock(&mpx_lock);
+	set_running_tb[per_cpu(event_set, cpu)] += now - *start;
+	spin_unlock(&mpx_lock);
+	*start = now;
+}
+
+static void nmi_cpu_switch(void * dummy)
+{
+	int cpu = smp_processor_id();
+	int set;
+	struct op_msrs * msrs = &cpu_msrs[cpu];
+
+	model->stop(msrs);
+	nmi_cpu_save_mpx_registers(msrs);
+	nmi_account_event_set(cpu, oprofile_get_tb());
+
+	set = (per_cpu(event_set, cpu) + 1) % num_event_sets;
+	per_cpu(event_set, cpu) = set;
+
+	spin_lock(&oprofilefs_lock);
+	model->switch_ctrl(msrs);
+	spin_unlock(&oprofilefs_lock);
+	nmi_cpu_restore_mpx_registers(msrs);
+	oprofile_add_event_set(set);
+	if (!per_cpu(nmi_task_off, cpu))
+		model->start(msrs);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+static int nmi_switch_event(void)
+{
+	/* nothing to rotate, stop the switch worker */
+	if (num_event_sets < 2)
+		return -EINVAL;
+
+	get_online_cpus();
+	if (ctr_running)
+		on_each_cpu(nmi_cpu_switch, NULL, 1);
+	put_online_cpus();
+
+	return 0;
+}
+#endif
+
+/* totals are in usecs as tb ticks would overflow an unsigned long */
+static unsigned long tb_to_usecs(uint64_t tb)
+{
+	unsigned long khz = oprofile_get_tb_khz();
+
+	tb *= 1000;
+	if (khz)
+		do_div(tb, khz);
+	return (unsigned long)tb;
+}
+
+static void nmi_update_event_times(void)
+{
+	int i, set;
+
+	spin_lock(&mpx_lock);
+	for (i = 0; i < num_virt_counters; ++i) {
+		set = virt_to_set(i);
+		counter_config[i].time_enabled = tb_to_usecs(enabled_tb);
+		counter_config[i].time_running = tb_to_usecs(set < 0 ?
+			enabled_tb : set_running_tb[set]);
+	}
+	spin_unlock(&mpx_lock);
+}
+
+static void nmi_read_counts(void)
+{
+	if (!nmi_enabled)
+		return;
+
+	model->read_counts(&cpu_msrs[smp_processor_id()]);
+}
+#endif // RRPROFILE
+
 static void nmi_cpu_setup(void * dummy)
 {
 	int cpu = smp_processor_id();
 	struct op_msrs * msrs = &cpu_msrs[cpu];
 	spin_lock(&oprofilefs_lock);
+#ifdef RRPROFILE
+	nmi_cpu_setup_mpx(msrs);
+#endif // RRPROFILE
 	model->setup_ctrs(msrs);
 	spin_unlock(&oprofilefs_lock);
 	saved_lvtpc[cpu] = apic_read(APIC_LVTPC);
@@ -293,6 +542,14 @@ static int nmi_setup(void)
 
 	nmi_enabled = 0;
 	ctr_running = 0;
+#ifdef RRPROFILE
+	spin_lock(&oprofilefs_lock);
+	num_event_sets = nmi_count_event_sets();
+	oprofile_record_sample_periods(nmi_any_freq());
+	spin_unlock(&oprofilefs_lock);
+	memset(set_running_tb, 0, sizeof(set_running_tb));
+	enabled_tb = 0;
+#endif // RRPROFILE
 	/* make variables visible to the nmi handler: */
 	smp_mb();
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
@@ -413,7 +670,13 @@ static void nmi_cpu_start(void * dummy)
 {
 	struct op_msrs const * msrs = &cpu_msrs[smp_processor_id()];
 #ifdef RRPROFILE
+	int cpu = smp_processor_id();
+
+	per_cpu(nmi_task_off, cpu) = 0;
 	oprofile_add_start(NULL);
+	per_cpu(cpu_start_tb, cpu) = per_cpu(set_start_tb, cpu) = oprofile_get_tb();
+	if (num_event_sets > 1)
+		oprofile_add_event_set(per_cpu(event_set, cpu));
 #endif // RRPROFILE
 	model->start(msrs);
 }
@@ -452,8 +715,18 @@ static int nmi_start(void)
 static void nmi_cpu_stop(void * dummy)
 {
 	struct op_msrs const * msrs = &cpu_msrs[smp_processor_id()];
+#ifdef RRPROFILE
+	int cpu = smp_processor_id();
+	uint64_t now;
+#endif // RRPROFILE
 	model->stop(msrs);
 #ifdef RRPROFILE
+	now = oprofile_get_tb();
+	nmi_account_event_set(cpu, now);
+	spin_lock(&mpx_lock);
+	enabled_tb += now - per_cpu(cpu_start_tb, cpu);
+	spin_unlock(&mpx_lock);
+
 	oprofile_add_stop(NULL);
 
 	disable_poll_idle();
@@ -478,8 +751,30 @@ static void nmi_stop(void)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
 	put_online_cpus();
 #endif
+
+#ifdef RRPROFILE
+	nmi_update_event_times();
+#endif // RRPROFILE
 }
 
+#ifdef RRPROFILE
+/* the stopped counters keep their values until a followed task runs */
+static void nmi_task_scope(int on)
+{
+	int cpu = smp_processor_id();
+	struct op_msrs const * msrs = &cpu_msrs[cpu];
+
+	if (!ctr_running)
+		return;
+
+	per_cpu(nmi_task_off, cpu) = !on;
+	if (on)
+		model->start(msrs);
+	else
+		model->stop(msrs);
+}
+#endif // RRPROFILE
+
 
 struct op_counter_config counter_config[OP_MAX_COUNTER];
 
@@ -518,7 +813,11 @@ static int nmi_create_files(struct super_block * sb, struct dentry * root)
 {
 	unsigned int i;
 
+#ifdef RRPROFILE
+	for (i = 0; i < num_virt_counters; ++i) {
+#else
 	for (i = 0; i < model->num_counters; ++i) {
+#endif // RRPROFILE
 		struct dentry * dir;
 #ifdef RRPROFILE
 		char buf[7];
@@ -536,52 +835,57 @@ static int nmi_create_files(struct super_block * sb, struct dentry * root)
 		oprofilefs_create_ulong(sb, dir, "unit_mask", &counter_config[i].unit_mask); 
 		oprofilefs_create_ulong(sb, dir, "kernel", &counter_config[i].kernel); 
 		oprofilefs_create_ulong(sb, dir, "user", &counter_config[i].user); 
+#ifdef RRPROFILE
+		oprofilefs_create_ulong(sb, dir, "freq", &counter_config[i].freq);
+		oprofilefs_create_ulong(sb, dir, "precise", &counter_config[i].precise);
+		oprofilefs_create_ro_ulong(sb, dir, "fixed", &counter_config[i].fixed);
+		oprofilefs_create_ro_ulong(sb, dir, "time_enabled", &counter_config[i].time_enabled);
+		oprofilefs_create_ro_ulong(sb, dir, "time_running", &counter_config[i].time_running);
+#endif // RRPROFILE
 	}
 	
 #ifdef RRPROFILE
 	/* Control polling of idle threads. */
 	oprofilefs_create_file(sb, root, "idle_poll", &idle_poll_fops);
+
+	if (op_lbr_supported()) {
+		oprofilefs_create_ulong(sb, root, "lbr_callstack", &lbr_callstack);
+		oprofilefs_create_ulong(sb, root, "lbr_branches", &lbr_branches);
+	}
+	op_rdpmc_create_files(sb, root);
 #endif // RRPROFILE
 
 	return 0;
 }
 
 #ifdef RRPROFILE
-static void nmi_cpu_adapt(void *dummy)
-{
-	int cpu = smp_processor_id();
-	struct op_msrs * msrs = &cpu_msrs[cpu];
-	spin_lock(&oprofilefs_lock);
-	model->setup_ctrs(msrs);
-	spin_unlock(&oprofilefs_lock);
-}
-
-
 static int nmi_adapt(void)
 {
 	int maxCounterValue = 0x7FFFFFFF / ADAPT_DECAY_FACTOR;
 	int i;
 
+	if (!model->adapt) {
+		return 0;
+	}
+
 	// Check if all enabled counters can be decayed.
-	for (i = 0; i < model->num_counters; ++i) {
+	for (i = 0; i < num_virt_counters; ++i) {
 		if(counter_config[i].enabled && counter_config[i].count >= maxCounterValue) {
 			return 0;
 		}
 	}
 
 	// Apply the decay factor to counter_config
-	for (i = 0; i < model->num_counters; ++i) {
+	for (i = 0; i < num_virt_counters; ++i) {
 		if(counter_config[i].enabled) {
 			counter_config[i].count *= ADAPT_DECAY_FACTOR;
 		}
 	}
 
-	// Apply the counter_config to the physical registers
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
-	on_each_cpu(nmi_cpu_adapt, NULL, 1);
-#else
-	on_each_cpu(nmi_cpu_adapt, NULL, 0, 1);
-#endif
+	// Publish the new reset values, the counters are left running
+	spin_lock(&oprofilefs_lock);
+	model->adapt();
+	spin_unlock(&oprofilefs_lock);
 
 	return 1;
 }
@@ -706,17 +1010,103 @@ static int __init ppro_init(char ** cpu_type)
 		spec = &op_arch_perfmon_spec;
 		*cpu_type = "i386/westmere";
 		break;
+	/* Intel Sandy Bridge */
 	case 42: // 0x2a - Intel Sandy Bridge
-	case 45: // 0x2d - Intel Sandy Bridge Xeon
+	case 45: // 0x2d - Intel Sandy Bridge-EP Xeon
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/sandybridge";
+		break;
+	/* Intel Ivy Bridge */
 	case 58: // 0x3a - Intel Ivy Bridge
+	case 62: // 0x3e - Intel Ivy Bridge-EP Xeon - Ivytown
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/ivybridge";
+		break;
+	/* Intel Haswell */
 	case 60: // 0x3c - Intel Haswell Desktop
-	case 62: // 0x3e - Intel Ivy Bridge-EP Xeon - Ivytown 
-	case 63: // 0x3f - Intel Haswell-E Xeon - Grantley 
-	case 69: // 0x45 - Intel Haswell ULT (MacBook Air)
-	case 70: // 0x46 - Intel Haswell Mobile
-	case 71: // 0x47 - Intel Haswell less mobile?
+	case 63: // 0x3f - Intel Haswell-E Xeon - Grantley
+	case 69: // 0x45 - Intel Haswell ULT
+	case 70: // 0x46 - Intel Haswell GT3e
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/haswell";
+		break;
+	/* Intel Broadwell */
+	case 61: // 0x3d - Intel Broadwell ULT
+	case 71: // 0x47 - Intel Broadwell GT3e
+	case 79: // 0x4f - Intel Broadwell-EP Xeon
+	case 86: // 0x56 - Intel Broadwell-DE Xeon
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/broadwell";
+		break;
+	/* Intel Skylake and the cores built on it */
+	case 78: // 0x4e - Intel Skylake Mobile
+	case 94: // 0x5e - Intel Skylake Desktop
+	case 85: // 0x55 - Intel Skylake-SP / Cascade Lake / Cooper Lake Xeon
+	case 142: // 0x8e - Intel Kaby Lake / Whiskey Lake / Comet Lake Mobile
+	case 158: // 0x9e - Intel Kaby Lake / Coffee Lake Desktop
+	case 165: // 0xa5 - Intel Comet Lake
+	case 166: // 0xa6 - Intel Comet Lake Mobile
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/skylake";
+		break;
+	/* Intel Sunny Cove and Willow Cove */
+	case 125: // 0x7d - Intel Ice Lake
+	case 126: // 0x7e - Intel Ice Lake Mobile
+	case 106: // 0x6a - Intel Ice Lake-SP Xeon
+	case 108: // 0x6c - Intel Ice Lake-D Xeon
+	case 140: // 0x8c - Intel Tiger Lake Mobile
+	case 141: // 0x8d - Intel Tiger Lake
+	case 167: // 0xa7 - Intel Rocket Lake
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/icelake";
+		break;
+	/* Intel Golden Cove and later server cores */
+	case 143: // 0x8f - Intel Sapphire Rapids Xeon
+	case 207: // 0xcf - Intel Emerald Rapids Xeon
+	case 173: // 0xad - Intel Granite Rapids Xeon
+	case 174: // 0xae - Intel Granite Rapids-D Xeon
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/sapphirerapids";
+		break;
+	/* Intel hybrid, performance and efficient cores */
+	case 151: // 0x97 - Intel Alder Lake
+	case 154: // 0x9a - Intel Alder Lake Mobile
+	case 183: // 0xb7 - Intel Raptor Lake
+	case 186: // 0xba - Intel Raptor Lake Mobile
+	case 191: // 0xbf - Intel Raptor Lake-S
+	case 170: // 0xaa - Intel Meteor Lake
+	case 172: // 0xac - Intel Meteor Lake-L
+	case 197: // 0xc5 - Intel Arrow Lake-H
+	case 198: // 0xc6 - Intel Arrow Lake
+	case 189: // 0xbd - Intel Lunar Lake
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/alderlake";
+		break;
+	/* Intel Atom Silvermont and Airmont */
+	case 55: // 0x37 - Intel Atom - Bay Trail
+	case 74: // 0x4a - Intel Atom - Merrifield
+	case 77: // 0x4d - Intel Atom - Avoton / Rangeley
+	case 90: // 0x5a - Intel Atom - Moorefield
+	case 93: // 0x5d - Intel Atom - SoFIA
+	case 76: // 0x4c - Intel Atom - Airmont / Cherry Trail
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/silvermont";
+		break;
+	/* Intel Atom Goldmont and Goldmont Plus */
+	case 92: // 0x5c - Intel Atom - Apollo Lake
+	case 95: // 0x5f - Intel Atom - Denverton
+	case 122: // 0x7a - Intel Atom - Gemini Lake
+		spec = &op_arch_perfmon_spec;
+		*cpu_type = "i386/goldmont";
+		break;
+	/* Intel Atom Tremont and later */
+	case 134: // 0x86 - Intel Atom - Snow Ridge / Jacobsville
+	case 150: // 0x96 - Intel Atom - Elkhart Lake
+	case 156: // 0x9c - Intel Atom - Jasper Lake
+	case 175: // 0xaf - Intel Atom - Sierra Forest
+	case 182: // 0xb6 - Intel Atom - Grand Ridge
 		spec = &op_arch_perfmon_spec;
-		*cpu_type = "i386/westmere"; // XXX no Sandy Bridge or Ivy Bridge or Haswell event lists (yet?)
+		*cpu_type = "i386/tremont";
 		break;
 	default:
 		return 0;
@@ -751,6 +1141,18 @@ static int __init ppro_init(char ** cpu_type)
 }
 #endif // RRPROFILE
 
+#ifdef RRPROFILE
+/* six counters at the core performance counter MSRs from family 15h on,
+ * unless a hypervisor doesn't pass them through */
+static struct op_x86_model_spec const * __init amd_core_model(void)
+{
+	if (cpuid_eax(0x80000000) >= 0x80000001 &&
+	    (cpuid_ecx(0x80000001) & AMD_PERFCTR_CORE))
+		return &op_amd_core_spec;
+	return &op_athlon_spec;
+}
+#endif // RRPROFILE
+
 /* in order to get driverfs right */
 static int using_nmi;
 
@@ -814,9 +1216,25 @@ int __init op_nmi_init(struct oprofile_operations *ops)
 				cpu_type = "x86-64/family14h";
 				break;
 			case 0x15:
-				model = &op_athlon_spec;
+				model = amd_core_model();
 				cpu_type = "x86-64/family15h";
 				break;
+			case 0x16:
+				model = amd_core_model();
+				cpu_type = "x86-64/family16h";
+				break;
+			case 0x17:
+				model = amd_core_model();
+				cpu_type = "x86-64/family17h";
+				break;
+			case 0x19:
+				model = amd_core_model();
+				cpu_type = "x86-64/family19h";
+				break;
+			case 0x1a:
+				model = amd_core_model();
+				cpu_type = "x86-64/family1ah";
+				break;
 #endif // RPROFILE
 			}
 			break;
@@ -881,6 +1299,9 @@ int __init op_nmi_init(struct oprofile_operations *ops)
 	ops->stop 			= nmi_stop;
 #ifdef RRPROFILE
 	ops->adapt			= nmi_adapt;
+	/* the counters are loaded with 31 bits, see CTR_WRITE */
+	ops->max_period		= 0x7FFFFFFF;
+	ops->task_scope		= nmi_task_scope;
 #endif // RRPROFILE
 	ops->cpu_type 		= cpu_type;
 
@@ -893,6 +1314,19 @@ int __init op_nmi_init(struct oprofile_operations *ops)
 	/* num_counters is finalized after init() is called */
 	ops->num_counters 	= model->num_counters;
 
+	num_virt_counters = model->num_counters;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	if (model->switch_ctrl && model->num_mpx_counters) {
+		num_virt_counters = OP_MAX_COUNTER;
+		ops->switch_events = nmi_switch_event;
+	}
+#endif
+	if (model->read_counts)
+		ops->read_counts = nmi_read_counts;
+	/* the LBR call stack doesn't survive a context switch */
+	if (op_lbr_supported())
+		ops->sched_switch = op_lbr_sched_switch;
+
 	init_driverfs();
 	using_nmi = 1;
 #endif // RRPROFILE
@@ -10,7 +10,11 @@
 #ifndef OP_COUNTER_H
 #define OP_COUNTER_H
  
+#ifdef RRPROFILE
+#define OP_MAX_COUNTER 32
+#else
 #define OP_MAX_COUNTER 8
+#endif // RRPROFILE
  
 /* Per-perfctr configuration as set via
  * oprofilefs.
@@ -22,8 +26,27 @@ struct op_counter_config {
         unsigned long kernel;
         unsigned long user;
         unsigned long unit_mask;
+#ifdef RRPROFILE
+        /* 1-based index of a fixed function counter, 0 if programmable */
+        unsigned long fixed;
+        /* usecs summed over all cpus that sampling was on, and that
+         * this counter's event set was on the counters */
+        unsigned long time_enabled;
+        unsigned long time_running;
+        /* samples a second on each cpu to adjust the period to, count
+         * is the first period. 0 samples every count events */
+        unsigned long freq;
+        /* nonzero to sample the exact instruction through PEBS */
+        unsigned long precise;
+#endif // RRPROFILE
 };
 
 extern struct op_counter_config counter_config[];
 
+#ifdef RRPROFILE
+/* sample events of IBS fetch and op samples, past any pmcN */
+#define OP_IBS_FETCH_EVENT	OP_MAX_COUNTER
+#define OP_IBS_OP_EVENT		(OP_MAX_COUNTER + 1)
+#endif // RRPROFILE
+
 #endif /* OP_COUNTER_H */
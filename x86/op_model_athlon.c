@@ -1,6 +1,6 @@
 /**
  * @file op_model_athlon.h
- * athlon / K7 / K8 / Family 10h model-specific MSR operations
+ * athlon / K7 / K8 / Family 10h on model-specific MSR operations
  *
  * @remark Copyright 2002 OProfile authors
  * @remark Read the file COPYING
@@ -14,9 +14,13 @@
 #include "../oprofile.h"
 #include <linux/smp.h>
 #include <linux/version.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
 #include <linux/percpu.h>
-#endif // >= 3.5.0
+#if defined(CONFIG_CPU_SUP_AMD) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
+#include <linux/fs.h>
+#include <asm/apic.h>
+#include <asm/perf_event.h>
+#define HAVE_IBS
+#endif
 #else
 #include <linux/oprofile.h>
 #endif // RRPROFILE
@@ -27,8 +31,21 @@
 #include "op_x86_model.h"
 #include "op_counter.h"
 
+#ifdef RRPROFILE
+/* family 15h on has six counters at the core performance counter MSRs,
+ * interleaved control then counter, four at the K7 ones before it */
+#ifndef MSR_F15H_PERF_CTL
+#define MSR_F15H_PERF_CTL	0xc0010200
+#define MSR_F15H_PERF_CTR	0xc0010201
+#endif
+#define NUM_COUNTERS_MAX 6
+#define NUM_COUNTERS num_counters
+#define NUM_CONTROLS num_counters
+static int num_counters = 4;
+#else
 #define NUM_COUNTERS 4
 #define NUM_CONTROLS 4
+#endif // RRPROFILE
 
 #define CTR_READ(l,h,msrs,c) do {rdmsr(msrs->counters[(c)].addr, (l), (h));} while (0)
 #define CTR_WRITE(l,msrs,c) do {wrmsr(msrs->counters[(c)].addr, -(unsigned int)(l), -1);} while (0)
@@ -57,14 +74,42 @@
 #define CTRL_SET_EVENT(val, e) (val |= e)
 #endif // RRPROFILE
 
+#ifdef RRPROFILE
+static unsigned long reset_value[NUM_COUNTERS_MAX];
+#else
 static unsigned long reset_value[NUM_COUNTERS];
+#endif // RRPROFILE
 
 #ifdef RRPROFILE
 static uint64_t start_timestamp[NR_CPUS];
+/* set when an NMI handled more than one overflow, see athlon_check_ctrs() */
+static DEFINE_PER_CPU(int, nmi_swallow);
+
+#ifdef HAVE_IBS
+static void op_amd_setup_ibs(void);
+static int op_amd_handle_ibs(struct pt_regs * const regs, uint64_t stop);
+#else
+static inline void op_amd_setup_ibs(void) { }
+static inline int op_amd_handle_ibs(struct pt_regs * const regs, uint64_t stop)
+{
+	return 0;
+}
+#endif
 #endif // RRPROFILE
  
 static void athlon_fill_in_addresses(struct op_msrs * const msrs)
 {
+#ifdef RRPROFILE
+	int i;
+
+	if (num_counters == NUM_COUNTERS_MAX) {
+		for (i = 0; i < NUM_COUNTERS_MAX; ++i) {
+			msrs->counters[i].addr = MSR_F15H_PERF_CTR + 2 * i;
+			msrs->controls[i].addr = MSR_F15H_PERF_CTL + 2 * i;
+		}
+		return;
+	}
+#endif // RRPROFILE
 	msrs->counters[0].addr = MSR_K7_PERFCTR0;
 	msrs->counters[1].addr = MSR_K7_PERFCTR1;
 	msrs->counters[2].addr = MSR_K7_PERFCTR2;
@@ -104,7 +149,13 @@ static void athlon_setup_ctrs(struct op_msrs const * const msrs)
 		if (counter_config[i].enabled) {
 			reset_value[i] = counter_config[i].count;
 
+#ifdef RRPROFILE
+			msrs->counters[i].period = oprofile_jitter_period(reset_value[i]);
+			msrs->counters[i].loaded_tb = oprofile_get_tb();
+			CTR_WRITE(msrs->counters[i].period, msrs, i);
+#else
 			CTR_WRITE(counter_config[i].count, msrs, i);
+#endif // RRPROFILE
 
 			CTRL_READ(low, high, msrs, i);
 #ifdef RRPROFILE
@@ -129,6 +180,9 @@ static void athlon_setup_ctrs(struct op_msrs const * const msrs)
 			reset_value[i] = 0;
 		}
 	}
+#ifdef RRPROFILE
+	op_amd_setup_ibs();
+#endif // RRPROFILE
 }
 
 #ifdef RRPROFILE
@@ -144,6 +198,7 @@ static int athlon_check_ctrs(struct pt_regs * const regs,
 #ifdef RRPROFILE
 	int cpu = smp_processor_id();
 	uint64_t end_timestamp = oprofile_get_tb();
+	int handled = 0;
 
 	athlon_stop(msrs);
 #endif // RRPROFILE
@@ -154,19 +209,47 @@ static int athlon_check_ctrs(struct pt_regs * const regs,
 #ifdef RRPROFILE
 			oprofile_add_sample_start(start_timestamp[cpu]);
 			oprofile_add_sample_stop(end_timestamp);
-#endif // RRPROFILE
+			oprofile_add_sample_period(msrs->counters[i].period);
+			oprofile_add_sample(regs, i);
+			if (counter_config[i].freq)
+				msrs->counters[i].period = oprofile_freq_period(
+					msrs->counters[i].period,
+					end_timestamp - msrs->counters[i].loaded_tb,
+					counter_config[i].freq);
+			else
+				msrs->counters[i].period = oprofile_jitter_period(reset_value[i]);
+			msrs->counters[i].loaded_tb = end_timestamp;
+			CTR_WRITE(msrs->counters[i].period, msrs, i);
+			++handled;
+#else
 			oprofile_add_sample(regs, i);
 			CTR_WRITE(reset_value[i], msrs, i);
+#endif // RRPROFILE
 		}
 	}
-
-	/* See op_model_ppro.c */
 #ifdef RRPROFILE
-	athlon_start(msrs);
+	handled += op_amd_handle_ibs(regs, end_timestamp);
+	oprofile_add_adapt();
+
+	if (!op_x86_task_off())
+		athlon_start(msrs);
 	start_timestamp[cpu] = oprofile_get_tb();
-#endif // RRPROFILE
-	
+
+	/* An NMI raised for an overflow the one before it already handled
+	 * finds nothing, any other one that finds nothing is not ours. */
+	if (handled) {
+		per_cpu(nmi_swallow, cpu) = handled > 1;
+		return 1;
+	}
+	if (per_cpu(nmi_swallow, cpu)) {
+		per_cpu(nmi_swallow, cpu) = 0;
+		return 1;
+	}
+	return 0;
+#else
+	/* See op_model_ppro.c */
 	return 1;
+#endif // RRPROFILE
 }
 
  
@@ -204,12 +287,336 @@ static void athlon_stop(struct op_msrs const * const msrs)
 }
 
 
+#ifdef RRPROFILE
+static void athlon_adapt(void)
+{
+	int i;
+
+	for (i = 0 ; i < NUM_COUNTERS ; ++i) {
+		if (counter_config[i].enabled)
+			reset_value[i] = counter_config[i].count;
+	}
+}
+#endif // RRPROFILE
+
+
+#ifdef RRPROFILE
+/*
+ * Instruction Based Sampling, family 10h on. Every max_count fetches or
+ * ops, IBS tags one and interrupts once it completes. Its exact address
+ * is sampled, preceded by the raw IBS registers: IbsFetchCtl,
+ * IbsFetchLinAd and IbsFetchPhysAd for a fetch, IbsOpRip, IbsOpData,
+ * IbsOpData2, IbsOpData3, IbsDcLinAd, IbsDcPhysAd and IbsBrTarget for
+ * an op, which hold the load latency and where the data hit in the
+ * caches and TLBs. The IBS NMI comes through an extended APIC LVT entry
+ * the kernel reserves at boot.
+ */
+#ifdef HAVE_IBS
+
+#ifndef MSR_AMD64_IBSBRTARGET
+#define MSR_AMD64_IBSBRTARGET		0xc001103b
+#endif
+#ifndef IBS_CAPS_BRNTRGT
+#define IBS_CAPS_BRNTRGT		(1U << 5)
+#define IBS_CAPS_OPCNTEXT		(1U << 6)
+#endif
+#ifndef IBSCTL_LVT_OFFSET_VALID
+#define IBSCTL_LVT_OFFSET_VALID		(1ULL << 8)
+#define IBSCTL_LVT_OFFSET_MASK		0x0f
+#endif
+
+#define IBS_FETCH_MAX_CNT_MASK		0xffffULL
+#define IBS_FETCH_EN			(1ULL << 48)
+#define IBS_FETCH_VALID			(1ULL << 49)
+#define IBS_FETCH_RAND_EN		(1ULL << 57)
+#define IBS_OP_MAX_CNT_MASK		0xffffULL
+#define IBS_OP_MAX_CNT_EXT_MASK		(0x7fULL << 20)
+#define IBS_OP_EN			(1ULL << 17)
+#define IBS_OP_VALID			(1ULL << 18)
+#define IBS_OP_CNT_CTL			(1ULL << 19)
+/* IbsOpData3 */
+#define IBS_OP_LD			(1ULL << 0)
+#define IBS_OP_ST			(1ULL << 1)
+#define IBS_OP_DC_LIN_ADDR_VALID	(1ULL << 17)
+#define IBS_OP_DC_MISS_LAT(d3)		(((d3) >> 32) & 0xffff)
+
+#define IBS_FETCH_REGS			3
+#define IBS_OP_REGS			7
+
+struct op_ibs_config {
+	unsigned long fetch_enabled;
+	unsigned long max_cnt_fetch;
+	unsigned long rand_en;
+	unsigned long op_enabled;
+	unsigned long max_cnt_op;
+	unsigned long dispatched_ops;
+};
+
+static struct op_ibs_config ibs_config;
+static u32 ibs_caps;
+/* counts the IBS fetch and op counters were last loaded with */
+static DEFINE_PER_CPU(unsigned long, ibs_fetch_period);
+static DEFINE_PER_CPU(unsigned long, ibs_op_period);
+static int (*create_arch_files)(struct super_block *sb, struct dentry *root);
+
+static int get_ibs_offset(void)
+{
+	u64 val;
+
+	rdmsrl(MSR_AMD64_IBSCTL, val);
+	if (!(val & IBSCTL_LVT_OFFSET_VALID))
+		return -EINVAL;
+	return val & IBSCTL_LVT_OFFSET_MASK;
+}
+
+static u64 op_amd_fetch_ctl(void)
+{
+	/* the count is in units of 16 */
+	u64 ctl = (max_t(unsigned long, ibs_config.max_cnt_fetch, 16) >> 4) &
+		IBS_FETCH_MAX_CNT_MASK;
+
+	per_cpu(ibs_fetch_period, smp_processor_id()) = ctl << 4;
+	ctl |= IBS_FETCH_EN;
+	if (ibs_config.rand_en)
+		ctl |= IBS_FETCH_RAND_EN;
+	return ctl;
+}
+
+static u64 op_amd_op_ctl(void)
+{
+	u64 cnt = max_t(unsigned long,
+			oprofile_jitter_period(ibs_config.max_cnt_op), 16) >> 4;
+	u64 ctl;
+
+	/* 23 bits of count with the extension, 16 without */
+	if (ibs_caps & IBS_CAPS_OPCNTEXT) {
+		cnt = min_t(u64, cnt, 0x7fffff);
+		ctl = (cnt & IBS_OP_MAX_CNT_MASK) |
+			((cnt << 4) & IBS_OP_MAX_CNT_EXT_MASK);
+	} else {
+		cnt = min_t(u64, cnt, IBS_OP_MAX_CNT_MASK);
+		ctl = cnt;
+	}
+
+	per_cpu(ibs_op_period, smp_processor_id()) = cnt << 4;
+	ctl |= IBS_OP_EN;
+	if (ibs_config.dispatched_ops)
+		ctl |= IBS_OP_CNT_CTL;
+	return ctl;
+}
+
+static void op_amd_setup_ibs(void)
+{
+	int offset;
+
+	if (!ibs_caps || (!ibs_config.fetch_enabled && !ibs_config.op_enabled))
+		return;
+
+	offset = get_ibs_offset();
+	if (offset < 0 || setup_APIC_eilvt(offset, 0, APIC_EILVT_MSG_NMI, 0))
+		printk(KERN_WARNING "rrprofile: IBS APIC setup failed on cpu %d\n",
+		       smp_processor_id());
+}
+
+static void op_amd_shutdown(struct op_msrs const * const msrs)
+{
+	int offset;
+
+	if (!ibs_caps || (!ibs_config.fetch_enabled && !ibs_config.op_enabled))
+		return;
+
+	offset = get_ibs_offset();
+	if (offset >= 0)
+		setup_APIC_eilvt(offset, 0, APIC_EILVT_MSG_FIX, 1);
+}
+
+/* the number of IBS samples taken */
+static int op_amd_handle_ibs(struct pt_regs * const regs, uint64_t stop)
+{
+	int cpu = smp_processor_id();
+	u64 data[IBS_OP_REGS];
+	u64 ctl;
+	int handled = 0;
+
+	if (!ibs_caps)
+		return 0;
+
+	if (ibs_config.fetch_enabled) {
+		rdmsrl(MSR_AMD64_IBSFETCHCTL, ctl);
+		if (ctl & IBS_FETCH_VALID) {
+			data[0] = ctl;
+			rdmsrl(MSR_AMD64_IBSFETCHLINAD, data[1]);
+			rdmsrl(MSR_AMD64_IBSFETCHPHYSAD, data[2]);
+
+			oprofile_add_sample_start(start_timestamp[cpu]);
+			oprofile_add_sample_stop(stop);
+			oprofile_add_sample_period(per_cpu(ibs_fetch_period, cpu));
+			oprofile_add_ibs_data(IBS_FETCH_CODE, data, IBS_FETCH_REGS);
+			oprofile_add_ext_sample(data[1], regs, OP_IBS_FETCH_EVENT,
+						data[1] >= PAGE_OFFSET);
+
+			wrmsrl(MSR_AMD64_IBSFETCHCTL, op_amd_fetch_ctl());
+			++handled;
+		}
+	}
+
+	if (ibs_config.op_enabled) {
+		rdmsrl(MSR_AMD64_IBSOPCTL, ctl);
+		if (ctl & IBS_OP_VALID) {
+			rdmsrl(MSR_AMD64_IBSOPRIP, data[0]);
+			rdmsrl(MSR_AMD64_IBSOPDATA, data[1]);
+			rdmsrl(MSR_AMD64_IBSOPDATA2, data[2]);
+			rdmsrl(MSR_AMD64_IBSOPDATA3, data[3]);
+			rdmsrl(MSR_AMD64_IBSDCLINAD, data[4]);
+			rdmsrl(MSR_AMD64_IBSDCPHYSAD, data[5]);
+			data[6] = 0;
+			if (ibs_caps & IBS_CAPS_BRNTRGT)
+				rdmsrl(MSR_AMD64_IBSBRTARGET, data[6]);
+
+			oprofile_add_sample_start(start_timestamp[cpu]);
+			oprofile_add_sample_stop(stop);
+			oprofile_add_sample_period(per_cpu(ibs_op_period, cpu));
+			/* loads and stores also as a data sample, like PEBS
+			 * gives them, with IbsOpData3 as the source */
+			if ((data[3] & (IBS_OP_LD | IBS_OP_ST)) &&
+			    (data[3] & IBS_OP_DC_LIN_ADDR_VALID))
+				oprofile_add_sample_data(data[4],
+					IBS_OP_DC_MISS_LAT(data[3]), data[3]);
+			oprofile_add_ibs_data(IBS_OP_CODE, data, IBS_OP_REGS);
+			oprofile_add_ext_sample(data[0], regs, OP_IBS_OP_EVENT,
+						data[0] >= PAGE_OFFSET);
+
+			wrmsrl(MSR_AMD64_IBSOPCTL, op_amd_op_ctl());
+			++handled;
+		}
+	}
+
+	return handled;
+}
+
+static void op_amd_start(struct op_msrs const * const msrs)
+{
+	athlon_start(msrs);
+
+	if (!ibs_caps)
+		return;
+	if (ibs_config.fetch_enabled)
+		wrmsrl(MSR_AMD64_IBSFETCHCTL, op_amd_fetch_ctl());
+	if (ibs_config.op_enabled)
+		wrmsrl(MSR_AMD64_IBSOPCTL, op_amd_op_ctl());
+}
+
+static void op_amd_stop(struct op_msrs const * const msrs)
+{
+	if (ibs_caps) {
+		if (ibs_config.fetch_enabled)
+			wrmsrl(MSR_AMD64_IBSFETCHCTL, 0);
+		if (ibs_config.op_enabled)
+			wrmsrl(MSR_AMD64_IBSOPCTL, 0);
+	}
+
+	athlon_stop(msrs);
+}
+
+static int setup_ibs_files(struct super_block *sb, struct dentry *root)
+{
+	struct dentry *dir;
+	int ret = 0;
+
+	if (create_arch_files)
+		ret = create_arch_files(sb, root);
+	if (ret)
+		return ret;
+
+	if (!ibs_caps)
+		return 0;
+
+	/* model specific files, same defaults as oprofile */
+	ibs_config.max_cnt_fetch = 250000;
+	ibs_config.fetch_enabled = 0;
+	ibs_config.rand_en = 1;
+	ibs_config.max_cnt_op = 250000;
+	ibs_config.op_enabled = 0;
+	ibs_config.dispatched_ops = 0;
+
+	dir = oprofilefs_mkdir(sb, root, "ibs_fetch");
+	oprofilefs_create_ulong(sb, dir, "enable", &ibs_config.fetch_enabled);
+	oprofilefs_create_ulong(sb, dir, "max_count", &ibs_config.max_cnt_fetch);
+	oprofilefs_create_ulong(sb, dir, "rand_enable", &ibs_config.rand_en);
+
+	dir = oprofilefs_mkdir(sb, root, "ibs_op");
+	oprofilefs_create_ulong(sb, dir, "enable", &ibs_config.op_enabled);
+	oprofilefs_create_ulong(sb, dir, "max_count", &ibs_config.max_cnt_op);
+	oprofilefs_create_ulong(sb, dir, "dispatched_ops", &ibs_config.dispatched_ops);
+
+	return 0;
+}
+
+static int op_amd_init(struct oprofile_operations *ops)
+{
+	ibs_caps = get_ibs_caps();
+	if (ibs_caps)
+		printk(KERN_INFO "rrprofile: IBS available, caps %#x.\n", ibs_caps);
+
+	create_arch_files = ops->create_files;
+	ops->create_files = setup_ibs_files;
+	return 0;
+}
+
+#endif // HAVE_IBS
+#endif // RRPROFILE
+
+#ifdef RRPROFILE
+static int op_amd_core_init(struct oprofile_operations *ops)
+{
+	num_counters = NUM_COUNTERS_MAX;
+#ifdef HAVE_IBS
+	return op_amd_init(ops);
+#else
+	return 0;
+#endif // HAVE_IBS
+}
+
+struct op_x86_model_spec const op_amd_core_spec = {
+	.num_counters = NUM_COUNTERS_MAX,
+	.num_controls = NUM_COUNTERS_MAX,
+	.fill_in_addresses = &athlon_fill_in_addresses,
+	.setup_ctrs = &athlon_setup_ctrs,
+	.check_ctrs = &athlon_check_ctrs,
+	.init = &op_amd_core_init,
+#ifdef HAVE_IBS
+	.start = &op_amd_start,
+	.stop = &op_amd_stop,
+	.shutdown = &op_amd_shutdown,
+#else
+	.start = &athlon_start,
+	.stop = &athlon_stop,
+#endif // HAVE_IBS
+	.adapt = &athlon_adapt
+};
+#endif // RRPROFILE
+
 struct op_x86_model_spec const op_athlon_spec = {
+#ifdef RRPROFILE
+	.num_counters = 4,
+	.num_controls = 4,
+#else
 	.num_counters = NUM_COUNTERS,
 	.num_controls = NUM_CONTROLS,
+#endif // RRPROFILE
 	.fill_in_addresses = &athlon_fill_in_addresses,
 	.setup_ctrs = &athlon_setup_ctrs,
 	.check_ctrs = &athlon_check_ctrs,
+#ifdef HAVE_IBS
+	.init = &op_amd_init,
+	.start = &op_amd_start,
+	.stop = &op_amd_stop,
+	.shutdown = &op_amd_shutdown,
+#else
 	.start = &athlon_start,
-	.stop = &athlon_stop
+	.stop = &athlon_stop,
+#endif // HAVE_IBS
+#ifdef RRPROFILE
+	.adapt = &athlon_adapt
+#endif // RRPROFILE
 };
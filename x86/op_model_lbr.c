@@ -0,0 +1,292 @@
+/**
+ * @file op_model_lbr.c
+ * Last Branch Record call stacks on architectural perfmon counters
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * From Haswell on, the LBR can be run as a stack of the user mode calls
+ * that haven't returned yet. With lbr_callstack set, the LBRs freeze on
+ * each counter interrupt and a user mode sample takes its backtrace from
+ * them, so binaries built without frame pointers get full call chains
+ * without reading user memory. Each entry is the address of the call
+ * instruction rather than the return address a frame pointer walk
+ * gives. The stack is cleared on context switches, as it would
+ * otherwise pop into the calls of the task switched from.
+ *
+ * With lbr_branches set instead, the LBRs record every taken branch and
+ * each counter sample carries them as its branch stack, with their
+ * misprediction and, where the format has them, cycle counts, for
+ * branch edge profiles such as AutoFDO takes.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <asm/ptrace.h>
+#include <asm/msr.h>
+#include <asm/processor.h>
+#include <asm/cpufeature.h>
+
+#include "../oprofile.h"
+#include "op_x86_model.h"
+
+#if defined(CONFIG_X86_64) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+
+#ifndef MSR_IA32_DEBUGCTLMSR
+#define MSR_IA32_DEBUGCTLMSR		0x1d9
+#endif
+#ifndef MSR_LBR_SELECT
+#define MSR_LBR_SELECT			0x1c8
+#define MSR_LBR_TOS			0x1c9
+#endif
+#ifndef MSR_LBR_NHM_FROM
+#define MSR_LBR_NHM_FROM		0x680
+#define MSR_LBR_NHM_TO			0x6c0
+#endif
+#ifndef MSR_LBR_INFO_0
+#define MSR_LBR_INFO_0			0xdc0
+#endif
+#ifndef MSR_IA32_PERF_CAPABILITIES
+#define MSR_IA32_PERF_CAPABILITIES	0x345
+#endif
+#ifndef MSR_CORE_PERF_GLOBAL_OVF_CTRL
+#define MSR_CORE_PERF_GLOBAL_OVF_CTRL	0x390
+#endif
+
+#define DEBUGCTL_LBR			(1ULL << 0)
+#define DEBUGCTL_FREEZE_LBRS_ON_PMI	(1ULL << 11)
+/* GLOBAL_STATUS bit of LBRs frozen by a PMI, perfmon v4 on */
+#define GLOBAL_STATUS_LBR_FRZ		(1ULL << 58)
+
+/* LBR_SELECT bits suppress the branches they name: keep user mode near
+ * calls and returns, and run the LBRs as a call stack */
+#define LBR_SELECT_CALLSTACK		0x3c5
+
+#define LBR_FORMAT(caps)		((caps) & 0x3f)
+/* Haswell's format, the first with call stack mode */
+#define LBR_FORMAT_EIP_FLAGS2		4
+/* flags and cycles in the LBR_INFO MSRs */
+#define LBR_FORMAT_INFO			5
+/* cycles in the top bits of the to address */
+#define LBR_FORMAT_TIME			6
+#define LBR_FORMAT_INFO2		7
+/* formats past it up to the architectural LBRs, which use other MSRs */
+#define LBR_FORMAT_MAX			7
+
+#define LBR_MISPRED			(1ULL << 63)
+#define LBR_CYCLES(v)			((v) & 0xffff)
+#define LBR_MAX_DEPTH			32
+
+/* the top bits hold branch flags, user and kernel addresses are 48 bit */
+#define LBR_ADDR(v)			((uint64_t)((s64)((v) << 16) >> 16))
+
+#define LBR_MODE_CALLSTACK		1
+#define LBR_MODE_BRANCHES		2
+
+unsigned long lbr_callstack;
+unsigned long lbr_branches;
+
+static int lbr_depth;
+static int lbr_format;
+static int lbr_perfmon_version;
+/* LBR_MODE_* running on each cpu, 0 if none */
+static DEFINE_PER_CPU(int, lbr_active);
+static DEFINE_PER_CPU(struct op_branch [LBR_MAX_DEPTH], lbr_stack);
+static DEFINE_PER_CPU(u64, saved_debugctl);
+static DEFINE_PER_CPU(u64, saved_lbr_select);
+
+static void lbr_flush(void)
+{
+	int i;
+
+	for (i = 0; i < lbr_depth; ++i)
+		wrmsrl(MSR_LBR_NHM_FROM + i, 0);
+}
+
+int op_lbr_init(int perfmon_version)
+{
+	u64 caps = 0;
+	int format;
+
+	lbr_depth = 0;
+#ifdef X86_FEATURE_PDCM
+	if (boot_cpu_has(X86_FEATURE_PDCM))
+		rdmsrl(MSR_IA32_PERF_CAPABILITIES, caps);
+#endif
+	format = LBR_FORMAT(caps);
+	if (perfmon_version < 3 || format < LBR_FORMAT_EIP_FLAGS2 ||
+	    format > LBR_FORMAT_MAX)
+		return 0;
+
+	lbr_format = format;
+	/* Haswell and Broadwell have 16 entries, Skylake on 32 */
+	lbr_depth = format == LBR_FORMAT_EIP_FLAGS2 ? 16 : 32;
+	lbr_perfmon_version = perfmon_version;
+	return lbr_depth;
+}
+
+int op_lbr_supported(void)
+{
+	return lbr_depth;
+}
+
+void op_lbr_setup(void)
+{
+	int cpu = smp_processor_id();
+
+	if (!lbr_depth || (!lbr_callstack && !lbr_branches))
+		return;
+
+	rdmsrl(MSR_IA32_DEBUGCTLMSR, per_cpu(saved_debugctl, cpu));
+	rdmsrl(MSR_LBR_SELECT, per_cpu(saved_lbr_select, cpu));
+
+	lbr_flush();
+	/* both share the LBRs, the call stack wins */
+	if (lbr_callstack) {
+		wrmsrl(MSR_LBR_SELECT, LBR_SELECT_CALLSTACK);
+		per_cpu(lbr_active, cpu) = LBR_MODE_CALLSTACK;
+	} else {
+		wrmsrl(MSR_LBR_SELECT, 0);
+		per_cpu(lbr_active, cpu) = LBR_MODE_BRANCHES;
+	}
+	wrmsrl(MSR_IA32_DEBUGCTLMSR, per_cpu(saved_debugctl, cpu) |
+	       DEBUGCTL_LBR | DEBUGCTL_FREEZE_LBRS_ON_PMI);
+}
+
+void op_lbr_shutdown(void)
+{
+	int cpu = smp_processor_id();
+
+	if (!per_cpu(lbr_active, cpu))
+		return;
+
+	per_cpu(lbr_active, cpu) = 0;
+	wrmsrl(MSR_IA32_DEBUGCTLMSR, per_cpu(saved_debugctl, cpu));
+	wrmsrl(MSR_LBR_SELECT, per_cpu(saved_lbr_select, cpu));
+}
+
+void op_lbr_sched_switch(void)
+{
+	if (per_cpu(lbr_active, smp_processor_id()) == LBR_MODE_CALLSTACK)
+		lbr_flush();
+}
+
+void op_lbr_unfreeze(void)
+{
+	int cpu = smp_processor_id();
+
+	if (!per_cpu(lbr_active, cpu))
+		return;
+
+	/* from perfmon v4 on the freeze is a status bit, before it the
+	 * PMI clears the LBR enable */
+	if (lbr_perfmon_version >= 4)
+		wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL, GLOBAL_STATUS_LBR_FRZ);
+	else
+		wrmsrl(MSR_IA32_DEBUGCTLMSR, per_cpu(saved_debugctl, cpu) |
+		       DEBUGCTL_LBR | DEBUGCTL_FREEZE_LBRS_ON_PMI);
+}
+
+int op_lbr_backtrace(struct pt_regs * const regs, unsigned int depth)
+{
+	unsigned long from;
+	u64 tos, entry;
+	int i;
+
+	if (per_cpu(lbr_active, smp_processor_id()) != LBR_MODE_CALLSTACK ||
+	    !user_mode(regs))
+		return 0;
+
+	rdmsrl(MSR_LBR_TOS, tos);
+	for (i = 0; i < lbr_depth && depth; ++i, --depth) {
+		rdmsrl(MSR_LBR_NHM_FROM + ((tos - i) & (lbr_depth - 1)), entry);
+		from = (unsigned long)LBR_ADDR(entry);
+		if (!from || from >= TASK_SIZE)
+			break;
+		oprofile_add_trace(from);
+	}
+
+	return 1;
+}
+
+void op_lbr_add_branches(void)
+{
+	int cpu = smp_processor_id();
+	struct op_branch *br = per_cpu(lbr_stack, cpu);
+	u64 tos, from, to, info;
+	int i, idx, nr = 0;
+
+	if (per_cpu(lbr_active, cpu) != LBR_MODE_BRANCHES)
+		return;
+
+	rdmsrl(MSR_LBR_TOS, tos);
+	for (i = 0; i < lbr_depth; ++i) {
+		idx = (tos - i) & (lbr_depth - 1);
+		rdmsrl(MSR_LBR_NHM_FROM + idx, from);
+		if (!from)
+			break;
+		rdmsrl(MSR_LBR_NHM_TO + idx, to);
+
+		if (lbr_format == LBR_FORMAT_INFO || lbr_format == LBR_FORMAT_INFO2)
+			rdmsrl(MSR_LBR_INFO_0 + idx, info);
+		else if (lbr_format == LBR_FORMAT_TIME)
+			info = (from & LBR_MISPRED) | LBR_CYCLES(to >> 48);
+		else
+			info = from & LBR_MISPRED;
+
+		br[nr].from = LBR_ADDR(from);
+		br[nr].to = LBR_ADDR(to);
+		br[nr].flags = (info & LBR_MISPRED) ? OP_BRANCH_MISPRED :
+			OP_BRANCH_PREDICTED;
+		br[nr].flags |= (unsigned long)LBR_CYCLES(info) << OP_BRANCH_CYCLES_SHIFT;
+		++nr;
+	}
+
+	if (nr)
+		oprofile_add_branch_stack(br, nr);
+}
+
+#else
+
+unsigned long lbr_callstack;
+unsigned long lbr_branches;
+
+int op_lbr_init(int perfmon_version)
+{
+	return 0;
+}
+
+int op_lbr_supported(void)
+{
+	return 0;
+}
+
+void op_lbr_setup(void)
+{
+}
+
+void op_lbr_shutdown(void)
+{
+}
+
+void op_lbr_sched_switch(void)
+{
+}
+
+void op_lbr_unfreeze(void)
+{
+}
+
+int op_lbr_backtrace(struct pt_regs * const regs, unsigned int depth)
+{
+	return 0;
+}
+
+void op_lbr_add_branches(void)
+{
+}
+
+#endif
@@ -631,7 +631,12 @@ static void p4_setup_ctrs(struct op_msrs const * const msrs)
 		if (counter_config[i].enabled) {
 			reset_value[i] = counter_config[i].count;
 			pmc_setup_one_p4_counter(i);
+#ifdef RRPROFILE
+			msrs->counters[i].period = oprofile_jitter_period(reset_value[i]);
+			CTR_WRITE(msrs->counters[i].period, VIRT_CTR(stag, i));
+#else
 			CTR_WRITE(counter_config[i].count, VIRT_CTR(stag, i));
+#endif // RRPROFILE
 		} else {
 			reset_value[i] = 0;
 		}
@@ -687,22 +692,35 @@ static int p4_check_ctrs(struct pt_regs * const regs,
 #ifdef RRPROFILE
 			oprofile_add_sample_start(end_timestamp);
 			oprofile_add_sample_stop(oprofile_get_tb());
-#endif // RRPROFILE
+			oprofile_add_sample_period(msrs->counters[i].period);
+			oprofile_add_sample(regs, i);
+			msrs->counters[i].period = oprofile_jitter_period(reset_value[i]);
+ 			CTR_WRITE(msrs->counters[i].period, real);
+			CCCR_CLEAR_OVF(low);
+			CCCR_WRITE(low, high, real);
+ 			CTR_WRITE(msrs->counters[i].period, real);
+#else
 			oprofile_add_sample(regs, i);
  			CTR_WRITE(reset_value[i], real);
 			CCCR_CLEAR_OVF(low);
 			CCCR_WRITE(low, high, real);
  			CTR_WRITE(reset_value[i], real);
+#endif // RRPROFILE
 		}
 	}
 
 	/* P4 quirk: you have to re-unmask the apic vector */
 	apic_write(APIC_LVTPC, apic_read(APIC_LVTPC) & ~APIC_LVT_MASKED);
 
+#ifdef RRPROFILE
+	oprofile_add_adapt();
+#endif // RRPROFILE
+
 	/* See op_model_ppro.c */
 	
 #ifdef RRPROFILE
-	p4_start(msrs);
+	if (!op_x86_task_off())
+		p4_start(msrs);
 	start_timestamp[cpu] = oprofile_get_tb();
 #endif // RRPROFILE
 	
@@ -746,6 +764,19 @@ static void p4_stop(struct op_msrs const * const msrs)
 }
 
 
+#ifdef RRPROFILE
+static void p4_adapt(void)
+{
+	int i;
+
+	for (i = 0; i < num_counters; ++i) {
+		if (counter_config[i].enabled)
+			reset_value[i] = counter_config[i].count;
+	}
+}
+#endif // RRPROFILE
+
+
 #ifdef CONFIG_SMP
 struct op_x86_model_spec const op_p4_ht2_spec = {
 	.num_counters = NUM_COUNTERS_HT2,
@@ -754,7 +785,10 @@ struct op_x86_model_spec const op_p4_ht2_spec = {
 	.setup_ctrs = &p4_setup_ctrs,
 	.check_ctrs = &p4_check_ctrs,
 	.start = &p4_start,
-	.stop = &p4_stop
+	.stop = &p4_stop,
+#ifdef RRPROFILE
+	.adapt = &p4_adapt
+#endif // RRPROFILE
 };
 #endif
 
@@ -765,5 +799,8 @@ struct op_x86_model_spec const op_p4_spec = {
 	.setup_ctrs = &p4_setup_ctrs,
 	.check_ctrs = &p4_check_ctrs,
 	.start = &p4_start,
-	.stop = &p4_stop
+	.stop = &p4_stop,
+#ifdef RRPROFILE
+	.adapt = &p4_adapt
+#endif // RRPROFILE
 };
@@ -0,0 +1,301 @@
+/**
+ * @file op_model_pebs.c
+ * Precise Event Based Sampling on architectural perfmon counters
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * A counter with pmcN/precise set has the cpu write a record of the
+ * registers to the DS save area when it overflows, instead of raising
+ * an interrupt whose IP skids past the instruction that caused it. The
+ * interrupt for a full buffer drains the records into samples, along
+ * with the data address, latency and source the record carries from
+ * format 1 on: for the load latency events, the precise store event of
+ * Sandy Bridge and Ivy Bridge, and from Haswell on every load and store
+ * event. Grouped by cache line along with the tid and cpu of their
+ * samples, they show the lines several threads contend for.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <asm/ptrace.h>
+#include <asm/msr.h>
+#include <asm/cpufeature.h>
+
+#include "../oprofile.h"
+#include "op_x86_model.h"
+#include "op_counter.h"
+
+#if defined(CONFIG_X86_64) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+
+#ifndef MSR_IA32_DS_AREA
+#define MSR_IA32_DS_AREA		0x600
+#endif
+#ifndef MSR_IA32_PEBS_ENABLE
+#define MSR_IA32_PEBS_ENABLE		0x3f1
+#endif
+#ifndef MSR_PEBS_LD_LAT_THRESHOLD
+#define MSR_PEBS_LD_LAT_THRESHOLD	0x3f6
+#endif
+#ifndef MSR_IA32_PERF_CAPABILITIES
+#define MSR_IA32_PERF_CAPABILITIES	0x345
+#endif
+
+/* PEBS_ENABLE bit for precise stores, on counter 3 only */
+#define PEBS_ENABLE_PRECISE_STORE	(1ULL << 63)
+
+/* IA32_MISC_ENABLE bit set when the cpu can't do PEBS */
+#define MISC_PEBS_UNAVAILABLE		(1ULL << 12)
+#define PEBS_FORMAT(caps)		(((caps) >> 8) & 0xf)
+#define PEBS_MAX_FORMAT			3
+
+/* records the buffer holds, one is enough as each interrupts */
+#define PEBS_BUFFER_RECORDS		16
+/* smallest latency in cycles a load is recorded for */
+#define PEBS_LD_LAT_MIN			3
+
+struct pebs_record {
+	/* format 0 */
+	u64 flags, ip;
+	u64 ax, bx, cx, dx;
+	u64 si, di, bp, sp;
+	u64 r8, r9, r10, r11;
+	u64 r12, r13, r14, r15;
+	/* format 1 */
+	u64 status, dla, dse, lat;
+	/* format 2 */
+	u64 real_ip, tsx_tuning;
+	/* format 3 */
+	u64 tsc;
+};
+
+static unsigned int const pebs_record_size[PEBS_MAX_FORMAT + 1] = {
+	offsetof(struct pebs_record, status),
+	offsetof(struct pebs_record, real_ip),
+	offsetof(struct pebs_record, tsc),
+	sizeof(struct pebs_record),
+};
+
+struct debug_store {
+	u64 bts_buffer_base;
+	u64 bts_index;
+	u64 bts_absolute_maximum;
+	u64 bts_interrupt_threshold;
+	u64 pebs_buffer_base;
+	u64 pebs_index;
+	u64 pebs_absolute_maximum;
+	u64 pebs_interrupt_threshold;
+	u64 pebs_event_reset[8];
+};
+
+static DEFINE_PER_CPU(struct debug_store *, pebs_ds);
+static DEFINE_PER_CPU(u64, saved_ds_area);
+static DEFINE_PER_CPU(u64, saved_pebs_enable);
+static int pebs_format;
+static int pebs_counters;
+
+static int pebs_detect(int num_gp_counters)
+{
+	u64 misc, caps = 0;
+
+	if (!boot_cpu_has(X86_FEATURE_DS))
+		return 0;
+
+	rdmsrl(MSR_IA32_MISC_ENABLE, misc);
+	if (misc & MISC_PEBS_UNAVAILABLE)
+		return 0;
+
+#ifdef X86_FEATURE_PTI
+	/* the DS area would have to live in the cpu entry area */
+	if (boot_cpu_has(X86_FEATURE_PTI)) {
+		printk(KERN_INFO "rrprofile: precise sampling not supported "
+		       "with page table isolation, use event_backend=perf.\n");
+		return 0;
+	}
+#endif
+
+#ifdef X86_FEATURE_PDCM
+	if (boot_cpu_has(X86_FEATURE_PDCM))
+		rdmsrl(MSR_IA32_PERF_CAPABILITIES, caps);
+#endif
+	pebs_format = PEBS_FORMAT(caps);
+	if (pebs_format > PEBS_MAX_FORMAT) {
+		printk(KERN_INFO "rrprofile: unknown PEBS record format %d.\n",
+		       pebs_format);
+		return 0;
+	}
+
+	/* the first PEBS cpus only had it on counter 0 */
+	if (!pebs_format)
+		return 1;
+	return min(num_gp_counters, 8);
+}
+
+int op_pebs_init(int num_gp_counters)
+{
+	struct debug_store *ds;
+	size_t size;
+	int cpu;
+
+	pebs_counters = pebs_detect(num_gp_counters);
+	if (!pebs_counters)
+		return 0;
+
+	size = sizeof(struct debug_store) +
+		PEBS_BUFFER_RECORDS * pebs_record_size[pebs_format];
+	for_each_possible_cpu(cpu) {
+		ds = kzalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+		per_cpu(pebs_ds, cpu) = ds;
+		if (!ds) {
+			op_pebs_exit();
+			return 0;
+		}
+	}
+
+	printk(KERN_INFO "rrprofile: precise sampling on %d counters, "
+	       "record format %d.\n", pebs_counters, pebs_format);
+	return pebs_counters;
+}
+
+void op_pebs_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(pebs_ds, cpu));
+		per_cpu(pebs_ds, cpu) = NULL;
+	}
+	pebs_counters = 0;
+}
+
+int op_pebs_counter(int i)
+{
+	return i < pebs_counters;
+}
+
+void op_pebs_setup(void)
+{
+	int cpu = smp_processor_id();
+	struct debug_store *ds = per_cpu(pebs_ds, cpu);
+	unsigned int size = pebs_record_size[pebs_format];
+
+	if (!pebs_counters)
+		return;
+
+	rdmsrl(MSR_IA32_DS_AREA, per_cpu(saved_ds_area, cpu));
+	rdmsrl(MSR_IA32_PEBS_ENABLE, per_cpu(saved_pebs_enable, cpu));
+	wrmsrl(MSR_IA32_PEBS_ENABLE, 0);
+
+	memset(ds, 0, sizeof(*ds));
+	ds->pebs_buffer_base = (unsigned long)(ds + 1);
+	ds->pebs_index = ds->pebs_buffer_base;
+	ds->pebs_absolute_maximum = ds->pebs_buffer_base +
+		PEBS_BUFFER_RECORDS * size;
+	ds->pebs_interrupt_threshold = ds->pebs_buffer_base + size;
+
+	wrmsrl(MSR_IA32_DS_AREA, (unsigned long)ds);
+}
+
+void op_pebs_enable(u64 enable, u64 load_latency, int store)
+{
+	if (!pebs_counters)
+		return;
+
+	if (load_latency)
+		wrmsrl(MSR_PEBS_LD_LAT_THRESHOLD, PEBS_LD_LAT_MIN);
+	if (store)
+		enable |= PEBS_ENABLE_PRECISE_STORE;
+	wrmsrl(MSR_IA32_PEBS_ENABLE, enable | (load_latency << 32));
+}
+
+void op_pebs_shutdown(void)
+{
+	int cpu = smp_processor_id();
+
+	if (!pebs_counters)
+		return;
+
+	wrmsrl(MSR_IA32_PEBS_ENABLE, per_cpu(saved_pebs_enable, cpu));
+	wrmsrl(MSR_IA32_DS_AREA, per_cpu(saved_ds_area, cpu));
+}
+
+u64 op_pebs_drain(struct pt_regs * const regs,
+		  struct op_msrs const * const msrs, u64 enabled,
+		  uint64_t start, uint64_t stop,
+		  void (*add_group)(struct op_msrs const * const msrs))
+{
+	struct debug_store *ds = per_cpu(pebs_ds, smp_processor_id());
+	unsigned int size = pebs_record_size[pebs_format];
+	struct pebs_record *rec;
+	unsigned long ip;
+	u64 at, status, drained = 0;
+	int i, virt;
+
+	for (at = ds->pebs_buffer_base; at < ds->pebs_index; at += size) {
+		rec = (struct pebs_record *)(unsigned long)at;
+
+		/* format 0 only records counter 0 */
+		status = pebs_format ? rec->status & enabled : 1;
+		if (!status)
+			continue;
+		i = __ffs(status);
+		virt = op_x86_phys_to_virt(i);
+
+		/* before format 2 the IP is the one after the instruction */
+		ip = pebs_format >= 2 && rec->real_ip ? rec->real_ip : rec->ip;
+
+		oprofile_add_sample_start(start);
+		oprofile_add_sample_stop(pebs_format >= 3 ? rec->tsc : stop);
+		oprofile_add_sample_period(msrs->counters[i].period);
+		if (pebs_format && rec->dla)
+			oprofile_add_sample_data(rec->dla, rec->lat, rec->dse);
+		op_lbr_add_branches();
+		add_group(msrs);
+		oprofile_add_ext_sample(ip, regs, virt, (long)ip < 0);
+		drained |= 1ULL << i;
+	}
+
+	ds->pebs_index = ds->pebs_buffer_base;
+	return drained;
+}
+
+#else
+
+int op_pebs_init(int num_gp_counters)
+{
+	return 0;
+}
+
+void op_pebs_exit(void)
+{
+}
+
+int op_pebs_counter(int i)
+{
+	return 0;
+}
+
+void op_pebs_setup(void)
+{
+}
+
+void op_pebs_enable(u64 enable, u64 load_latency, int store)
+{
+}
+
+void op_pebs_shutdown(void)
+{
+}
+
+u64 op_pebs_drain(struct pt_regs * const regs,
+		  struct op_msrs const * const msrs, u64 enabled,
+		  uint64_t start, uint64_t stop,
+		  void (*add_group)(struct op_msrs const * const msrs))
+{
+	return 0;
+}
+
+#endif
@@ -14,6 +14,9 @@
 #include <linux/errno.h>
 #include <linux/version.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
 #include "../oprofile.h"
 #else
 #include <linux/oprofile.h>
@@ -29,6 +32,11 @@
 #ifdef RRPROFILE
 static int num_counters = 2;
 static int counter_width = 32;
+/* counters 0..num_gp_counters-1 are general purpose, the rest fixed */
+static int num_gp_counters = 2;
+static int num_fixed_counters;
+static int fixed_counter_width;
+static int arch_perfmon_version;
 #else
 #define NUM_COUNTERS 2
 #define NUM_CONTROLS 2
@@ -49,9 +57,56 @@ static int counter_width = 32;
 #define CTRL_SET_UM(val, m) (val |= (m << 8))
 #define CTRL_SET_EVENT(val, e) (val |= e)
 
+#ifdef RRPROFILE
+#ifndef MSR_CORE_PERF_FIXED_CTR0
+#define MSR_CORE_PERF_FIXED_CTR0	0x309
+#define MSR_CORE_PERF_FIXED_CTR_CTRL	0x38d
+#define MSR_CORE_PERF_GLOBAL_CTRL	0x38f
+#endif
+#ifndef MSR_CORE_PERF_GLOBAL_STATUS
+#define MSR_CORE_PERF_GLOBAL_STATUS	0x38e
+#define MSR_CORE_PERF_GLOBAL_OVF_CTRL	0x390
+#endif
+/* GLOBAL_STATUS bit for a PEBS buffer past its interrupt threshold */
+#define GLOBAL_STATUS_OVF_BUFFER	(1ULL << 62)
+
+#define IS_FIXED(c) ((c) >= num_gp_counters)
+#define FIXED_IDX(c) ((c) - num_gp_counters)
+
+/* fixed counters take the full width, writes beyond it fault */
+#define FIXED_CTR_WRITE(l,msrs,c) do {wrmsrl(msrs->counters[(c)].addr, \
+	-(u64)(l) & ((1ULL << fixed_counter_width) - 1));} while (0)
+
+/* controls past the general purpose ones */
+#define FIXED_CTRL(msrs) (msrs->controls[num_gp_counters].addr)
+#define GLOBAL_CTRL(msrs) (msrs->controls[num_gp_counters + 1].addr)
+#define HAS_GLOBAL_CTRL(msrs) (num_fixed_counters && GLOBAL_CTRL(msrs))
+
+/* 4 bits per fixed counter in FIXED_CTR_CTRL: kernel, user, any thread, pmi */
+#define FIXED_CTRL_MASK(f) (0xfULL << (4 * (f)))
+#define FIXED_CTRL_KERN(f) (0x1ULL << (4 * (f)))
+#define FIXED_CTRL_USR(f) (0x2ULL << (4 * (f)))
+#define FIXED_CTRL_PMI(f) (0x8ULL << (4 * (f)))
+#endif // RRPROFILE
+
 #ifdef RRPROFILE
 static u64 *reset_value;
 static uint64_t start_timestamp[NR_CPUS];
+/* counters let through GLOBAL_CTRL while running */
+static u64 global_enable;
+/* an NMI raced with one that handled several counters */
+static int nmi_swallow[NR_CPUS];
+/* counters sampling through PEBS on each cpu */
+static u64 pebs_enable[NR_CPUS];
+
+/* what each pmcN read on this cpu when last recorded, by the sample
+ * groups and by the counting mode reads */
+struct ppro_last {
+	u64 group[OP_MAX_COUNTER];
+	u64 count[OP_MAX_COUNTER];
+	struct op_group_value values[OP_MAX_COUNTER];
+};
+static DEFINE_PER_CPU(struct ppro_last, ppro_last);
 #else
 static unsigned long reset_value[NUM_COUNTERS];
 #endif // RRPROFILE
@@ -71,13 +126,25 @@ union rr_cpuid10_eax {
 	unsigned int full;
 };
 
+union rr_cpuid10_edx {
+	struct {
+		unsigned int num_counters_fixed:5;
+		unsigned int bit_width_fixed:8;
+		unsigned int reserved:19;
+	} split;
+	unsigned int full;
+};
+
 
 static int ppro_init(struct oprofile_operations *ignore)
 {
 	if (!reset_value) {
-		reset_value = kmalloc(sizeof(reset_value[0]) * num_counters, GFP_ATOMIC);
+		/* indexed by pmcN, which may outnumber the counters */
+		reset_value = kmalloc(sizeof(reset_value[0]) * OP_MAX_COUNTER, GFP_ATOMIC);
 		if (!reset_value)
 			return -ENOMEM;
+		/* without its pages there is just no rdpmc file */
+		op_rdpmc_init();
 	}
 
 	return 0;
@@ -86,22 +153,253 @@ static int ppro_init(struct oprofile_operations *ignore)
 
 static void ppro_fill_in_addresses(struct op_msrs * const msrs)
 {
+#ifdef RRPROFILE
+	int i;
+
+	for (i = 0; i < num_gp_counters; ++i) {
+		msrs->counters[i].addr = MSR_P6_PERFCTR0 + i;
+		msrs->controls[i].addr = MSR_P6_EVNTSEL0 + i;
+	}
+
+	if (!num_fixed_counters)
+		return;
+
+	for (i = 0; i < num_fixed_counters; ++i)
+		msrs->counters[num_gp_counters + i].addr = MSR_CORE_PERF_FIXED_CTR0 + i;
+	FIXED_CTRL(msrs) = MSR_CORE_PERF_FIXED_CTR_CTRL;
+	/* the global enables gate the fixed counters from version 2 on */
+	if (arch_perfmon_version >= 2)
+		GLOBAL_CTRL(msrs) = MSR_CORE_PERF_GLOBAL_CTRL;
+#else
 	msrs->counters[0].addr = MSR_P6_PERFCTR0;
 	msrs->counters[1].addr = MSR_P6_PERFCTR1;
 	
 	msrs->controls[0].addr = MSR_P6_EVNTSEL0;
 	msrs->controls[1].addr = MSR_P6_EVNTSEL1;
+#endif // RRPROFILE
 }
 
 
+#ifdef RRPROFILE
+static u64 ppro_ctr_mask(int i)
+{
+	return (1ULL << (IS_FIXED(i) ? fixed_counter_width : counter_width)) - 1;
+}
+
+/* what rotating pmcN @virt was saved with, or is restored from */
+static u64 ppro_saved(struct op_msrs const * const msrs, int virt)
+{
+	struct op_saved_msr const *saved = &msrs->multiplex[virt].saved;
+
+	return ((u64)saved->high << 32 | saved->low) & ppro_ctr_mask(0);
+}
+
+/* load counter @i with its period, the next sample group counts from it */
+static void ppro_write_period(struct op_msrs const * const msrs, int i)
+{
+	struct ppro_last *last = &per_cpu(ppro_last, smp_processor_id());
+	struct op_rdpmc_page *page = op_rdpmc_page();
+	unsigned long period = msrs->counters[i].period;
+	int virt = op_x86_phys_to_virt(i);
+	u64 old = 0;
+
+	if (page)
+		rdmsrl(msrs->counters[i].addr, old);
+
+	if (IS_FIXED(i)) {
+		FIXED_CTR_WRITE(period, msrs, i);
+		last->group[virt] = -(u64)period & ppro_ctr_mask(i);
+	} else {
+		CTR_WRITE(period, msrs, i);
+		last->group[virt] = -(u64)(u32)period & ppro_ctr_mask(i);
+	}
+
+	/* user mode rdpmc counts on from where the counter was. Loaded
+	 * periods keep the top bit set, a clear one means the counter
+	 * wrapped past 2^width, which the reader's mask dropped */
+	if (page) {
+		old &= ppro_ctr_mask(i);
+		if (!(old & ((ppro_ctr_mask(i) >> 1) + 1)))
+			old += ppro_ctr_mask(i) + 1;
+		++page->lock;
+		barrier();
+		page->counter[virt].offset += old - last->group[virt];
+		barrier();
+		++page->lock;
+	}
+}
+
+/* publish where user mode rdpmc finds each pmcN, counting from 0 */
+static void ppro_rdpmc_publish(struct op_msrs const * const msrs)
+{
+	struct ppro_last *last = &per_cpu(ppro_last, smp_processor_id());
+	struct op_rdpmc_page *page = op_rdpmc_page();
+	struct op_rdpmc_counter *ctr;
+	int i, virt;
+
+	if (!page)
+		return;
+
+	++page->lock;
+	barrier();
+	for (virt = 0; virt < OP_MAX_COUNTER; ++virt) {
+		if (counter_config[virt].enabled)
+			page->counter[virt].width = counter_width;
+	}
+	for (i = 0; i < num_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled)
+			continue;
+		ctr = &page->counter[virt];
+		if (IS_FIXED(i)) {
+			ctr->index = ((1U << 30) | FIXED_IDX(i)) + 1;
+			ctr->width = fixed_counter_width;
+		} else {
+			ctr->index = i + 1;
+		}
+		ctr->offset = -(s64)last->group[virt];
+	}
+	barrier();
+	++page->lock;
+}
+
+/* carry the counts user mode rdpmc reads over a rotation, the counters
+ * hold what the multiplex state saved of the pmcN on them */
+static void ppro_rdpmc_switch(struct op_msrs const * const msrs)
+{
+	struct op_rdpmc_page *page = op_rdpmc_page();
+	struct op_rdpmc_counter *ctr;
+	int i, virt;
+
+	if (!page)
+		return;
+
+	++page->lock;
+	barrier();
+	for (virt = 0; virt < OP_MAX_COUNTER; ++virt) {
+		ctr = &page->counter[virt];
+		if (!ctr->index || ctr->index > num_gp_counters)
+			continue;
+		ctr->offset += ppro_saved(msrs, virt);
+		ctr->index = 0;
+	}
+	for (i = 0; i < num_gp_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled)
+			continue;
+		ctr = &page->counter[virt];
+		ctr->offset -= ppro_saved(msrs, virt);
+		ctr->index = i + 1;
+	}
+	barrier();
+	++page->lock;
+}
+
+/* record what every active counter counted since the last group */
+static void ppro_add_group(struct op_msrs const * const msrs)
+{
+	struct ppro_last *last = &per_cpu(ppro_last, smp_processor_id());
+	u64 val;
+	int i, virt, nr = 0;
+
+	if (!oprofile_sample_group)
+		return;
+
+	for (i = 0; i < num_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled)
+			continue;
+		rdmsrl(msrs->counters[i].addr, val);
+		val &= ppro_ctr_mask(i);
+		last->values[nr].counter = virt;
+		last->values[nr].delta = (val - last->group[virt]) & ppro_ctr_mask(i);
+		last->group[virt] = val;
+		++nr;
+	}
+
+	if (nr)
+		oprofile_add_sample_group(last->values, nr);
+}
+
+/* nonzero if general purpose counter @i samples through PEBS */
+static int ppro_precise(struct op_msrs const * const msrs, int i)
+{
+	int virt = op_x86_phys_to_virt(i);
+
+	return HAS_GLOBAL_CTRL(msrs) && op_pebs_counter(i) &&
+		counter_config[virt].enabled && counter_config[virt].precise &&
+		reset_value[virt];
+}
+
+/* the load latency events, MEM_INST_RETIRED.LATENCY_ABOVE_THRESHOLD
+ * before Sandy Bridge and MEM_TRANS_RETIRED.LOAD_LATENCY from it on */
+static int ppro_load_latency(struct op_counter_config const *ctr)
+{
+	return (ctr->event == 0xcd && (ctr->unit_mask & 0x01)) ||
+		(ctr->event == 0x0b && (ctr->unit_mask & 0x10));
+}
+
+/* MEM_TRANS_RETIRED.PRECISE_STORE of Sandy Bridge and Ivy Bridge, later
+ * cores record the address of every store event */
+static int ppro_precise_store(struct op_counter_config const *ctr)
+{
+	return ctr->event == 0xcd && (ctr->unit_mask & 0x02);
+}
+
+static void ppro_pebs_enable(struct op_msrs const * const msrs)
+{
+	int cpu = smp_processor_id();
+	u64 enable = 0, load_latency = 0;
+	int i, store = 0;
+
+	for (i = 0; i < num_gp_counters; ++i) {
+		if (!ppro_precise(msrs, i))
+			continue;
+		enable |= 1ULL << i;
+		if (ppro_load_latency(&counter_config[op_x86_phys_to_virt(i)]))
+			load_latency |= 1ULL << i;
+		else if (i == 3 &&
+			 ppro_precise_store(&counter_config[op_x86_phys_to_virt(i)]))
+			store = 1;
+	}
+
+	pebs_enable[cpu] = enable;
+	op_pebs_enable(enable, load_latency, store);
+}
+
+/* program general purpose counter @i for the pmcN it currently counts */
+static void ppro_setup_ctrl(struct op_msrs const * const msrs, int i)
+{
+	struct op_counter_config *ctr = &counter_config[op_x86_phys_to_virt(i)];
+	unsigned int low, high;
+
+	CTRL_READ(low, high, msrs, i);
+	CTRL_CLEAR(low);
+	if (ctr->enabled) {
+		/* counting mode counters don't interrupt, PEBS ones
+		 * interrupt once their record is written */
+		if (ctr->count && !ppro_precise(msrs, i))
+			CTRL_SET_ENABLE(low);
+		CTRL_SET_USR(low, ctr->user);
+		CTRL_SET_KERN(low, ctr->kernel);
+		CTRL_SET_UM(low, ctr->unit_mask);
+		CTRL_SET_EVENT(low, ctr->event);
+	}
+	CTRL_WRITE(low, high, msrs, i);
+}
+#endif // RRPROFILE
+
 static void ppro_setup_ctrs(struct op_msrs const * const msrs)
 {
 	unsigned int low, high;
 	int i;
+#ifdef RRPROFILE
+	struct ppro_last *last;
+#endif // RRPROFILE
 
 	/* clear all counters */
 #ifdef RRPROFILE
-	for (i = 0 ; i < num_counters; ++i) {
+	for (i = 0 ; i < num_gp_counters; ++i) {
 #else
 	for (i = 0 ; i < NUM_CONTROLS; ++i) {
 #endif // RRPROFILE
@@ -109,22 +407,65 @@ static void ppro_setup_ctrs(struct op_msrs const * const msrs)
 		CTRL_CLEAR(low);
 		CTRL_WRITE(low, high, msrs, i);
 	}
+#ifdef RRPROFILE
+	if (num_fixed_counters)
+		wrmsrl(FIXED_CTRL(msrs), 0);
+#endif // RRPROFILE
 	
 	/* avoid a false detection of ctr overflows in NMI handler */
 #ifdef RRPROFILE
 	for (i = 0; i < num_counters; ++i) {
+		if (IS_FIXED(i))
+			FIXED_CTR_WRITE(1, msrs, i);
+		else
+			CTR_WRITE(1, msrs, i);
+	}
 #else
 	for (i = 0; i < NUM_COUNTERS; ++i) {
-#endif // RRPROFILE
 		CTR_WRITE(1, msrs, i);
 	}
+#endif // RRPROFILE
 
 	/* enable active counters */
 #ifdef RRPROFILE
+	for (i = 0; i < OP_MAX_COUNTER; ++i) {
+		if (counter_config[i].enabled)
+			reset_value[i] = counter_config[i].count;
+	}
+
+	/* the rotating pmcN not on the counters go on from where they
+	 * were set up to start */
+	last = &per_cpu(ppro_last, smp_processor_id());
+	for (i = 0; i < OP_MAX_COUNTER; ++i) {
+		last->group[i] = 0;
+		if (msrs->multiplex && counter_config[i].enabled)
+			last->group[i] = ppro_saved(msrs, i);
+		last->count[i] = last->group[i];
+	}
+
 	for (i = 0; i < num_counters; ++i) {
+		int virt = op_x86_phys_to_virt(i);
+
+		if (!counter_config[virt].enabled)
+			continue;
+
+		if (!reset_value[virt]) {
+			/* counting mode, runs freely from 0 */
+			msrs->counters[i].period = 0;
+			wrmsrl(msrs->counters[i].addr, 0);
+			last->group[virt] = 0;
+			last->count[virt] = 0;
+		} else {
+			msrs->counters[i].period = oprofile_jitter_period(reset_value[virt]);
+			msrs->counters[i].loaded_tb = oprofile_get_tb();
+			ppro_write_period(msrs, i);
+		}
+		/* fixed function ones are enabled in FIXED_CTR_CTRL on start */
+		if (!IS_FIXED(i))
+			ppro_setup_ctrl(msrs, i);
+	}
 #else
 	for (i = 0; i < NUM_COUNTERS; ++i) {
-#endif // RRPROFILE
 		if (counter_config[i].enabled) {
 			reset_value[i] = counter_config[i].count;
 
@@ -140,13 +481,151 @@ static void ppro_setup_ctrs(struct op_msrs const * const msrs)
 			CTRL_WRITE(low, high, msrs, i);
 		}
 	}
+#endif // RRPROFILE
+
+#ifdef RRPROFILE
+	/* let the used counters through the global enables, all general
+	 * purpose ones as event sets rotate over them */
+	if (HAS_GLOBAL_CTRL(msrs)) {
+		u64 global = (1ULL << num_gp_counters) - 1;
+
+		for (i = num_gp_counters; i < num_counters; ++i) {
+			if (counter_config[i].enabled)
+				global |= 1ULL << (32 + FIXED_IDX(i));
+		}
+		global_enable = global;
+		wrmsrl(GLOBAL_CTRL(msrs), global);
+		wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL,
+		       global | GLOBAL_STATUS_OVF_BUFFER);
+
+		op_pebs_setup();
+		ppro_pebs_enable(msrs);
+		op_lbr_setup();
+	}
+
+	op_rdpmc_setup();
+	ppro_rdpmc_publish(msrs);
+#endif // RRPROFILE
 }
 
+#ifdef RRPROFILE
+/* pick the period to reload counter @i with, after it overflowed at @now */
+static void ppro_next_period(struct op_msrs const * const msrs, int i,
+			     int virt, uint64_t now)
+{
+	struct op_msr *ctr = &msrs->counters[i];
+
+	if (counter_config[virt].freq)
+		ctr->period = oprofile_freq_period(ctr->period,
+			now - ctr->loaded_tb, counter_config[virt].freq);
+	else
+		ctr->period = oprofile_jitter_period(reset_value[virt]);
+	ctr->loaded_tb = now;
+}
+
+static void ppro_switch_ctrl(struct op_msrs const * const msrs)
+{
+	int i;
+
+	for (i = 0; i < num_gp_counters; ++i)
+		ppro_setup_ctrl(msrs, i);
+	if (HAS_GLOBAL_CTRL(msrs))
+		ppro_pebs_enable(msrs);
+	ppro_rdpmc_switch(msrs);
+}
+#endif // RRPROFILE
+
 #ifdef RRPROFILE
 static void ppro_start(struct op_msrs const * const msrs);
 static void ppro_stop(struct op_msrs const * const msrs);
 #endif // RRPROFILE
 
+#ifdef RRPROFILE
+/*
+ * From perfmon version 2 on, all counters are frozen and unfrozen with a
+ * single write of GLOBAL_CTRL, and GLOBAL_STATUS tells which of them
+ * overflowed, instead of stopping each counter and reading them all.
+ */
+static int ppro_check_ctrs_global(struct pt_regs * const regs,
+				  struct op_msrs const * const msrs)
+{
+	int cpu = smp_processor_id();
+	uint64_t end_timestamp = oprofile_get_tb();
+	u64 status, drained;
+	int i, virt, bit, handled = 0;
+
+	wrmsrl(GLOBAL_CTRL(msrs), 0);
+
+	rdmsrl(MSR_CORE_PERF_GLOBAL_STATUS, status);
+	status &= global_enable | GLOBAL_STATUS_OVF_BUFFER;
+	if (!status) {
+		wrmsrl(GLOBAL_CTRL(msrs), global_enable);
+		/* the counters an NMI was raised for may have been handled
+		 * by the one before it, otherwise it is not ours */
+		if (nmi_swallow[cpu]) {
+			nmi_swallow[cpu] = 0;
+			return 1;
+		}
+		return 0;
+	}
+
+	do {
+		wrmsrl(MSR_CORE_PERF_GLOBAL_OVF_CTRL, status);
+
+		/* PEBS counters are sampled from their records, their
+		 * overflow bits don't carry a sample of their own */
+		if (status & GLOBAL_STATUS_OVF_BUFFER) {
+			drained = op_pebs_drain(regs, msrs, pebs_enable[cpu],
+				start_timestamp[cpu], end_timestamp,
+				ppro_add_group);
+			for (i = 0; i < num_gp_counters; ++i) {
+				if (!(drained & (1ULL << i)))
+					continue;
+				ppro_next_period(msrs, i, op_x86_phys_to_virt(i),
+						 end_timestamp);
+				ppro_write_period(msrs, i);
+				++handled;
+			}
+		}
+		status &= global_enable & ~pebs_enable[cpu];
+
+		for (bit = 0; bit < 64; ++bit) {
+			if (!(status & (1ULL << bit)))
+				continue;
+			i = bit < 32 ? bit : num_gp_counters + bit - 32;
+			virt = op_x86_phys_to_virt(i);
+			/* counting mode counters are read by ppro_read_counts() */
+			if (!reset_value[virt])
+				continue;
+
+			oprofile_add_sample_start(start_timestamp[cpu]);
+			oprofile_add_sample_stop(end_timestamp);
+			oprofile_add_sample_period(msrs->counters[i].period);
+			op_lbr_add_branches();
+			ppro_add_group(msrs);
+			oprofile_add_sample(regs, virt);
+			ppro_next_period(msrs, i, virt, end_timestamp);
+			ppro_write_period(msrs, i);
+			++handled;
+		}
+
+		rdmsrl(MSR_CORE_PERF_GLOBAL_STATUS, status);
+		status &= global_enable | GLOBAL_STATUS_OVF_BUFFER;
+	} while (status);
+
+	nmi_swallow[cpu] = handled > 1;
+	oprofile_add_adapt();
+
+	op_lbr_unfreeze();
+	apic_write(APIC_LVTPC, apic_read(APIC_LVTPC) & ~APIC_LVT_MASKED);
+
+	wrmsrl(GLOBAL_CTRL(msrs), global_enable);
+	start_timestamp[cpu] = oprofile_get_tb();
+
+	return 1;
+}
+#endif // RRPROFILE
+
 static int ppro_check_ctrs(struct pt_regs * const regs,
 			   struct op_msrs const * const msrs)
 {
@@ -154,13 +633,22 @@ static int ppro_check_ctrs(struct pt_regs * const regs,
 	int i;
 #ifdef RRPROFILE
 	int cpu = smp_processor_id();
-	uint64_t end_timestamp = oprofile_get_tb();
+	uint64_t end_timestamp;
+
+	if (HAS_GLOBAL_CTRL(msrs))
+		return ppro_check_ctrs_global(regs, msrs);
 
+	end_timestamp = oprofile_get_tb();
 	ppro_stop(msrs);
 #endif // RRPROFILE
 	
 #ifdef RRPROFILE
 	for (i = 0 ; i < num_counters; ++i) {
+		int virt = op_x86_phys_to_virt(i);
+
+		/* counting mode counters are read by ppro_read_counts() */
+		if (!reset_value[virt])
+			continue;
 #else
 	for (i = 0 ; i < NUM_COUNTERS; ++i) {
 #endif // RRPROFILE
@@ -169,18 +657,28 @@ static int ppro_check_ctrs(struct pt_regs * const regs,
 #ifdef RRPROFILE
 			oprofile_add_sample_start(start_timestamp[cpu]);
 			oprofile_add_sample_stop(end_timestamp);
-#endif // RRPROFILE
+			oprofile_add_sample_period(msrs->counters[i].period);
+			ppro_add_group(msrs);
+			oprofile_add_sample(regs, virt);
+			ppro_next_period(msrs, i, virt, end_timestamp);
+			ppro_write_period(msrs, i);
+#else
 			oprofile_add_sample(regs, i);
 			CTR_WRITE(reset_value[i], msrs, i);
+#endif // RRPROFILE
 		}
 	}
+#ifdef RRPROFILE
+	oprofile_add_adapt();
+#endif // RRPROFILE
 
 	/* Only P6 based Pentium M need to re-unmask the apic vector but it
 	 * doesn't hurt other P6 variant */
 	apic_write(APIC_LVTPC, apic_read(APIC_LVTPC) & ~APIC_LVT_MASKED);
 
 #ifdef RRPROFILE
-	ppro_start(msrs);
+	if (!op_x86_task_off())
+		ppro_start(msrs);
 	start_timestamp[cpu] = oprofile_get_tb();
 #endif // RRPROFILE
 
@@ -201,26 +699,123 @@ static void ppro_start(struct op_msrs const * const msrs)
 	unsigned int low,high;
 #ifdef RRPROFILE
 	int cpu = smp_processor_id();
+	u64 fixed;
+	int i;
+
 	start_timestamp[cpu] = oprofile_get_tb();
-#endif // RRPROFILE
 
+	/* the P6 enable bit of EVNTSEL0 gates both counters, architectural
+	 * perfmon has one per counter plus the fixed counter fields */
+	for (i = 0; i < (arch_perfmon_version ? num_gp_counters : 1); ++i) {
+		if (arch_perfmon_version &&
+		    !counter_config[op_x86_phys_to_virt(i)].enabled)
+			continue;
+		CTRL_READ(low, high, msrs, i);
+		CTRL_SET_ACTIVE(low);
+		CTRL_WRITE(low, high, msrs, i);
+	}
+
+	if (!num_fixed_counters)
+		return;
+
+	rdmsrl(FIXED_CTRL(msrs), fixed);
+	for (i = num_gp_counters; i < num_counters; ++i) {
+		if (!counter_config[i].enabled)
+			continue;
+		fixed &= ~FIXED_CTRL_MASK(FIXED_IDX(i));
+		if (counter_config[i].count)
+			fixed |= FIXED_CTRL_PMI(FIXED_IDX(i));
+		if (counter_config[i].kernel)
+			fixed |= FIXED_CTRL_KERN(FIXED_IDX(i));
+		if (counter_config[i].user)
+			fixed |= FIXED_CTRL_USR(FIXED_IDX(i));
+	}
+	wrmsrl(FIXED_CTRL(msrs), fixed);
+#else
 	CTRL_READ(low, high, msrs, 0);
 	CTRL_SET_ACTIVE(low);
 	CTRL_WRITE(low, high, msrs, 0);
+#endif // RRPROFILE
 }
 
 
 static void ppro_stop(struct op_msrs const * const msrs)
 {
 	unsigned int low,high;
+#ifdef RRPROFILE
+	u64 fixed;
+	int i;
+
+	for (i = 0; i < (arch_perfmon_version ? num_gp_counters : 1); ++i) {
+		CTRL_READ(low, high, msrs, i);
+		CTRL_SET_INACTIVE(low);
+		CTRL_WRITE(low, high, msrs, i);
+	}
+
+	if (!num_fixed_counters)
+		return;
+
+	rdmsrl(FIXED_CTRL(msrs), fixed);
+	for (i = 0; i < num_fixed_counters; ++i)
+		fixed &= ~FIXED_CTRL_MASK(i);
+	wrmsrl(FIXED_CTRL(msrs), fixed);
+#else
 	CTRL_READ(low, high, msrs, 0);
 	CTRL_SET_INACTIVE(low);
 	CTRL_WRITE(low, high, msrs, 0);
+#endif // RRPROFILE
 }
 
 #ifdef RRPROFILE
+static void ppro_adapt(void)
+{
+	int i;
+
+	/* a counter doesn't change between sampling and counting mode
+	 * without a new setup */
+	for (i = 0; i < OP_MAX_COUNTER; ++i) {
+		if (counter_config[i].enabled && reset_value[i] &&
+		    counter_config[i].count)
+			reset_value[i] = counter_config[i].count;
+	}
+}
+
+/* report what the counting mode counters counted since the last read,
+ * leaving them running for the sample groups */
+static void ppro_read_counts(struct op_msrs const * const msrs)
+{
+	struct ppro_last *last = &per_cpu(ppro_last, smp_processor_id());
+	u64 val, delta;
+	int i, virt;
+
+	for (i = 0; i < num_counters; ++i) {
+		virt = op_x86_phys_to_virt(i);
+		if (!counter_config[virt].enabled || reset_value[virt])
+			continue;
+
+		rdmsrl(msrs->counters[i].addr, val);
+		val &= ppro_ctr_mask(i);
+		delta = (val - last->count[virt]) & ppro_ctr_mask(i);
+		last->count[virt] = val;
+		if (delta)
+			oprofile_add_count(virt, delta);
+	}
+}
+
+static void ppro_shutdown(struct op_msrs const * const msrs)
+{
+	op_rdpmc_shutdown();
+	if (!HAS_GLOBAL_CTRL(msrs))
+		return;
+
+	op_lbr_shutdown();
+	op_pebs_shutdown();
+}
+
 static void ppro_exit(void)
 {
+	op_rdpmc_exit();
+	op_pebs_exit();
 	if (reset_value) {
 		kfree(reset_value);
 		reset_value = NULL;
@@ -235,6 +830,7 @@ struct op_x86_model_spec const op_ppro_spec = {
     .exit = &ppro_exit,
 	.num_counters = 2, /* can be overriden */
 	.num_controls = 2, /* ditto */
+	.num_mpx_counters = 2,
 #else
 	.num_counters = NUM_COUNTERS,
 	.num_controls = NUM_CONTROLS,
@@ -243,7 +839,13 @@ struct op_x86_model_spec const op_ppro_spec = {
 	.setup_ctrs = &ppro_setup_ctrs,
 	.check_ctrs = &ppro_check_ctrs,
 	.start = &ppro_start,
-	.stop = &ppro_stop
+	.stop = &ppro_stop,
+#ifdef RRPROFILE
+	.shutdown = &ppro_shutdown,
+	.adapt = &ppro_adapt,
+	.switch_ctrl = &ppro_switch_ctrl,
+	.read_counts = &ppro_read_counts
+#endif // RRPROFILE
 };
 
 #ifdef RRPROFILE
@@ -256,11 +858,64 @@ struct op_x86_model_spec const op_ppro_spec = {
  * the specific CPU.
  */
 
+/* CPUID 7 EDX, performance and efficient cores in one package */
+#define CPUID7_EDX_HYBRID (1U << 15)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+static void arch_perfmon_cpuid(void *info)
+{
+	unsigned int *regs = info;
+
+	regs[0] = cpuid_eax(0xa);
+	regs[1] = cpuid_edx(0xa);
+}
+
+/* each core type of a hybrid part enumerates its own counters, keep to
+ * those every cpu has, as the same pmcN setup goes to all of them */
+static void arch_perfmon_hybrid_min(union rr_cpuid10_eax *eax,
+				    union rr_cpuid10_edx *edx)
+{
+	union rr_cpuid10_eax e;
+	union rr_cpuid10_edx d;
+	unsigned int regs[2];
+	int cpu;
+
+	if (boot_cpu_data.cpuid_level < 7 ||
+	    !(cpuid_edx(7) & CPUID7_EDX_HYBRID))
+		return;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		smp_call_function_single(cpu, arch_perfmon_cpuid, regs, 1);
+		e.full = regs[0];
+		d.full = regs[1];
+		eax->split.num_events = min_t(unsigned int,
+			eax->split.num_events, e.split.num_events);
+		eax->split.bit_width = min_t(unsigned int,
+			eax->split.bit_width, e.split.bit_width);
+		edx->split.num_counters_fixed = min_t(unsigned int,
+			edx->split.num_counters_fixed, d.split.num_counters_fixed);
+		edx->split.bit_width_fixed = min_t(unsigned int,
+			edx->split.bit_width_fixed, d.split.bit_width_fixed);
+	}
+	put_online_cpus();
+}
+#else
+static void arch_perfmon_hybrid_min(union rr_cpuid10_eax *eax,
+				    union rr_cpuid10_edx *edx)
+{
+}
+#endif
+
 static void arch_perfmon_setup_counters(void)
 {
 	union rr_cpuid10_eax eax;
+	union rr_cpuid10_edx edx;
+	int i;
 
 	eax.full = cpuid_eax(0xa);
+	edx.full = cpuid_edx(0xa);
+	arch_perfmon_hybrid_min(&eax, &edx);
 
 	/* Workaround for BIOS bugs in 6/15. Taken from perfmon2 */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
@@ -278,16 +933,41 @@ static void arch_perfmon_setup_counters(void)
 	if (counter_width < eax.split.bit_width)
 		counter_width = eax.split.bit_width;
 
-	// FIXME: We need to implement support for > 2 pmcs.
-	// num_counters = eax.split.num_events;
-	num_counters = 2;
+	arch_perfmon_version = eax.split.version_id;
+	num_gp_counters = min_t(int, eax.split.num_events, OP_MAX_COUNTER);
+
+	/* fixed counters are only enumerated from version 2 on */
+	num_fixed_counters = 0;
+	if (arch_perfmon_version >= 2 && edx.split.num_counters_fixed) {
+		num_fixed_counters = min_t(int, edx.split.num_counters_fixed,
+					   OP_MAX_COUNTER - num_gp_counters);
+		fixed_counter_width = edx.split.bit_width_fixed;
+		if (!fixed_counter_width || fixed_counter_width > 64)
+			fixed_counter_width = 40;
+	}
+
+	/* the fixed counters follow the general purpose ones as pmcN,
+	 * user space tells them apart by their pmcN/fixed file */
+	num_counters = num_gp_counters + num_fixed_counters;
+	for (i = 0; i < OP_MAX_COUNTER; ++i)
+		counter_config[i].fixed = (i >= num_gp_counters && i < num_counters) ?
+			i - num_gp_counters + 1 : 0;
+
 	op_arch_perfmon_spec.num_counters = num_counters;
-	op_arch_perfmon_spec.num_controls = num_counters;
+	op_arch_perfmon_spec.num_mpx_counters = num_gp_counters;
+	/* plus FIXED_CTR_CTRL and GLOBAL_CTRL */
+	op_arch_perfmon_spec.num_controls = num_gp_counters +
+		(num_fixed_counters ? 2 : 0);
 }
 
 static int arch_perfmon_init(struct oprofile_operations *ignore)
 {
 	arch_perfmon_setup_counters();
+	/* PEBS interrupts are told apart through GLOBAL_STATUS */
+	if (arch_perfmon_version >= 2 && num_fixed_counters) {
+		op_pebs_init(num_gp_counters);
+		op_lbr_init(arch_perfmon_version);
+	}
 	return ppro_init(ignore);
 }
 
@@ -300,6 +980,10 @@ struct op_x86_model_spec op_arch_perfmon_spec = {
 	.check_ctrs             = &ppro_check_ctrs,
 	.start                  = &ppro_start,
 	.stop                   = &ppro_stop,
+	.shutdown               = &ppro_shutdown,
+	.adapt                  = &ppro_adapt,
+	.switch_ctrl            = &ppro_switch_ctrl,
+	.read_counts            = &ppro_read_counts,
 	.exit					= &ppro_exit
 };
 #endif // RRPROFILE
@@ -0,0 +1,227 @@
+/**
+ * @file op_model_rdpmc.c
+ * User mode rdpmc of the counters being profiled with
+ *
+ * @remark Copyright 2002 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * With user_rdpmc set, a process that maps the "rdpmc" file may read the
+ * counters itself while profiling runs, in a few instructions and
+ * without a system call. The file holds one page per cpu, cpu N at
+ * offset N * PAGE_SIZE, each a struct op_rdpmc_page. For every pmcN it
+ * has the rdpmc index plus one while pmcN is on a counter of that cpu,
+ * 0 while it is rotated out, and the offset that turns what rdpmc
+ * returns into the count since the profile started, across sampling
+ * reloads and event set rotation. A read goes:
+ *
+ *	do {
+ *		cpu = the cpu running on, from rseq or rdtscp;
+ *		seq = page[cpu].lock; barrier();
+ *		idx = page[cpu].counter[n].index;
+ *		count = page[cpu].counter[n].offset;
+ *		if (idx)
+ *			count += rdpmc(idx - 1) & ((1 << width) - 1);
+ *		barrier();
+ *	} while (page[cpu].lock != seq || the cpu changed);
+ *
+ * A counter that wraps interrupts before the reader goes on, and the
+ * reload moves the offset by 2^width and bumps lock, so the loop reads
+ * again rather than return the wrapped count.
+ *
+ * From 4.0 on the kernel sets CR4.PCE for the processes that asked for
+ * it only, so mapping the file is what allows rdpmc to a process, as
+ * mapping a perf event does. Before it, rdpmc is allowed to all
+ * processes while profiling.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <asm/processor.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+#include <asm/tlbflush.h>
+#endif
+
+#include "../oprofile.h"
+#include "op_x86_model.h"
+
+unsigned long user_rdpmc;
+
+static struct page *rdpmc_pages[NR_CPUS];
+/* the page of each cpu, while setup for user_rdpmc */
+static struct op_rdpmc_page *rdpmc_active[NR_CPUS];
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+static int saved_pce[NR_CPUS];
+#endif
+
+int op_rdpmc_init(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		rdpmc_pages[cpu] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!rdpmc_pages[cpu]) {
+			op_rdpmc_exit();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void op_rdpmc_exit(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		if (rdpmc_pages[cpu])
+			__free_page(rdpmc_pages[cpu]);
+		rdpmc_pages[cpu] = NULL;
+	}
+}
+
+struct op_rdpmc_page *op_rdpmc_page(void)
+{
+	return rdpmc_active[smp_processor_id()];
+}
+
+void op_rdpmc_setup(void)
+{
+	int cpu = smp_processor_id();
+	struct op_rdpmc_page *page;
+
+	if (!user_rdpmc || !rdpmc_pages[cpu])
+		return;
+
+	page = page_address(rdpmc_pages[cpu]);
+	++page->lock;
+	barrier();
+	memset(page->counter, 0, sizeof(page->counter));
+	page->nr = OP_MAX_COUNTER;
+	barrier();
+	++page->lock;
+	rdpmc_active[cpu] = page;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+	saved_pce[cpu] = read_cr4() & X86_CR4_PCE;
+	set_in_cr4(X86_CR4_PCE);
+#endif
+}
+
+void op_rdpmc_shutdown(void)
+{
+	int cpu = smp_processor_id();
+	struct op_rdpmc_page *page = rdpmc_active[cpu];
+	int i;
+
+	if (!page)
+		return;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+	if (!saved_pce[cpu])
+		clear_in_cr4(X86_CR4_PCE);
+#endif
+
+	/* the counts stay readable as they were last */
+	++page->lock;
+	barrier();
+	for (i = 0; i < OP_MAX_COUNTER; ++i)
+		page->counter[i].index = 0;
+	barrier();
+	++page->lock;
+	rdpmc_active[cpu] = NULL;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0) && defined(CONFIG_PERF_EVENTS)
+static void rdpmc_refresh_pce(void *info)
+{
+	struct mm_struct *mm = info;
+
+	if (current->active_mm != mm)
+		return;
+	if (atomic_read(&mm->context.perf_rdpmc_allowed))
+		cr4_set_bits(X86_CR4_PCE);
+	else
+		cr4_clear_bits(X86_CR4_PCE);
+}
+
+/* the same count perf keeps for mapped events, the context switch sets
+ * CR4.PCE for the mm while it is nonzero */
+static void rdpmc_vm_open(struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = vma->vm_mm;
+
+	if (atomic_inc_return(&mm->context.perf_rdpmc_allowed) == 1)
+		on_each_cpu_mask(mm_cpumask(mm), rdpmc_refresh_pce, mm, 1);
+}
+
+static void rdpmc_vm_close(struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = vma->vm_mm;
+
+	if (atomic_dec_and_test(&mm->context.perf_rdpmc_allowed))
+		on_each_cpu_mask(mm_cpumask(mm), rdpmc_refresh_pce, mm, 1);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+/* without perf the context switch always clears CR4.PCE */
+#define RDPMC_UNAVAILABLE
+#else
+static void rdpmc_vm_open(struct vm_area_struct *vma)
+{
+}
+
+static void rdpmc_vm_close(struct vm_area_struct *vma)
+{
+}
+#endif
+
+#ifndef RDPMC_UNAVAILABLE
+static const struct vm_operations_struct rdpmc_vm_ops = {
+	.open		= rdpmc_vm_open,
+	.close		= rdpmc_vm_close,
+};
+
+static int rdpmc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long addr = vma->vm_start;
+	int cpu;
+
+	if (!user_rdpmc)
+		return -EPERM;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != nr_cpu_ids * PAGE_SIZE)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu, addr += PAGE_SIZE) {
+		if (remap_pfn_range(vma, addr, page_to_pfn(rdpmc_pages[cpu]),
+				    PAGE_SIZE, vma->vm_page_prot))
+			return -EAGAIN;
+	}
+
+	vma->vm_ops = &rdpmc_vm_ops;
+	rdpmc_vm_open(vma);
+	return 0;
+}
+
+static const struct file_operations rdpmc_fops = {
+	.mmap		= rdpmc_mmap,
+};
+#endif
+
+int op_rdpmc_create_files(struct super_block *sb, struct dentry *root)
+{
+#ifdef RDPMC_UNAVAILABLE
+	return 0;
+#else
+	if (!rdpmc_pages[0])
+		return 0;
+
+	oprofilefs_create_ulong(sb, root, "user_rdpmc", &user_rdpmc);
+	return oprofilefs_create_file_perm(sb, root, "rdpmc", &rdpmc_fops, 0444);
+#endif
+}
@@ -11,6 +11,10 @@
 #ifndef OP_X86_MODEL_H
 #define OP_X86_MODEL_H
 
+#ifdef RRPROFILE
+#include "op_counter.h"
+#endif // RRPROFILE
+
 struct op_saved_msr {
 	unsigned int high;
 	unsigned int low;
@@ -19,11 +23,21 @@ struct op_saved_msr {
 struct op_msr {
 	unsigned long addr;
 	struct op_saved_msr saved;
+#ifdef RRPROFILE
+	/* period currently loaded into this counter */
+	unsigned long period;
+	/* when it was loaded, for counters sampling at a frequency */
+	uint64_t loaded_tb;
+#endif // RRPROFILE
 };
 
 struct op_msrs {
 	struct op_msr * counters;
 	struct op_msr * controls;
+#ifdef RRPROFILE
+	/* saved state of every pmcN while its event set is off the counters */
+	struct op_msr * multiplex;
+#endif // RRPROFILE
 };
 
 struct pt_regs;
@@ -35,6 +49,8 @@ struct op_x86_model_spec {
 #ifdef RRPROFILE
 	unsigned int num_counters;
 	unsigned int num_controls;
+	/* leading counters that rotate through event sets, 0 if none */
+	unsigned int num_mpx_counters;
 #else
 	unsigned int const num_counters;
 	unsigned int const num_controls;
@@ -51,6 +67,15 @@ struct op_x86_model_spec {
 	void (*stop)(struct op_msrs const * const msrs);
 #ifdef RRPROFILE
 	void (*shutdown)(struct op_msrs const * const msrs);
+	/* take over the counts in counter_config as new reset values,
+	 * each cpu reloads them at its next overflow */
+	void (*adapt)(void);
+	/* program the controls of the rotating counters for the event set
+	 * now current on this cpu, see op_x86_phys_to_virt(). Optional. */
+	void (*switch_ctrl)(struct op_msrs const * const msrs);
+	/* report what the counting mode counters of this cpu counted
+	 * since they were last read. Optional. */
+	void (*read_counts)(struct op_msrs const * const msrs);
 #endif // RRPROFILE
 };
 
@@ -58,6 +83,11 @@ extern struct op_x86_model_spec const op_ppro_spec;
 extern struct op_x86_model_spec const op_p4_spec;
 extern struct op_x86_model_spec const op_p4_ht2_spec;
 extern struct op_x86_model_spec const op_athlon_spec;
+#ifdef RRPROFILE
+extern struct op_x86_model_spec const op_amd_core_spec;
+/* CPUID 0x80000001 ECX, the core performance counter extensions */
+#define AMD_PERFCTR_CORE	(1U << 23)
+#endif // RRPROFILE
 
 #ifdef RRPROFILE
 extern struct op_x86_model_spec op_arch_perfmon_spec;
@@ -69,6 +99,77 @@ void disable_poll_idle (void);
 void exit_poll_idle (void);
 
 extern int rr_cpu_has_arch_perfmon;
+
+/* pmcN currently counting on physical counter @phys of this cpu */
+int op_x86_phys_to_virt(int phys);
+/* nonzero while the task_filter keeps the counters of this cpu stopped,
+ * check_ctrs then leaves them stopped */
+int op_x86_task_off(void);
+
+/* precise sampling through the DS save area, see op_model_pebs.c */
+int op_pebs_init(int num_gp_counters);
+void op_pebs_exit(void);
+/* nonzero if general purpose counter @i can sample precisely */
+int op_pebs_counter(int i);
+/* per cpu, point the DS area at this cpu's buffer */
+void op_pebs_setup(void);
+/* per cpu, sample the counters in @enable precisely, the ones in
+ * @load_latency as loads with their latency, counter 3 with @store set
+ * as stores with their address */
+void op_pebs_enable(u64 enable, u64 load_latency, int store);
+void op_pebs_shutdown(void);
+/* turn the records of this cpu into samples, calling @add_group before
+ * each, returns the counters that had records */
+u64 op_pebs_drain(struct pt_regs * const regs,
+		  struct op_msrs const * const msrs, u64 enabled,
+		  uint64_t start, uint64_t stop,
+		  void (*add_group)(struct op_msrs const * const msrs));
+
+/* LBR call stacks for user mode backtraces, see op_model_lbr.c */
+extern unsigned long lbr_callstack;
+extern unsigned long lbr_branches;
+int op_lbr_init(int perfmon_version);
+/* nonzero if the cpu has LBR call stack mode */
+int op_lbr_supported(void);
+/* per cpu, run the LBRs as a call stack if lbr_callstack is set, or
+ * else as branch stack if lbr_branches is */
+void op_lbr_setup(void);
+void op_lbr_shutdown(void);
+void op_lbr_sched_switch(void);
+/* per cpu, at the end of a counter interrupt */
+void op_lbr_unfreeze(void);
+/* add the call stack as the backtrace of a user mode sample, zero if
+ * the LBRs don't hold it */
+int op_lbr_backtrace(struct pt_regs * const regs, unsigned int depth);
+/* record the branch stack for the sample that follows */
+void op_lbr_add_branches(void);
+
+/* the page user mode rdpmc reads each cpu's counters through, the count
+ * of pmcN is offset plus what rdpmc(index - 1) returns, in width bits */
+struct op_rdpmc_counter {
+	u32 index;
+	u32 width;
+	s64 offset;
+};
+
+struct op_rdpmc_page {
+	/* changes on every update */
+	u32 lock;
+	u32 nr;
+	struct op_rdpmc_counter counter[OP_MAX_COUNTER];
+};
+
+/* user mode rdpmc of the counters, see op_model_rdpmc.c */
+extern unsigned long user_rdpmc;
+int op_rdpmc_init(void);
+void op_rdpmc_exit(void);
+int op_rdpmc_create_files(struct super_block *sb, struct dentry *root);
+/* per cpu, publish the counters if user_rdpmc is set */
+void op_rdpmc_setup(void);
+void op_rdpmc_shutdown(void);
+/* this cpu's page while published, or NULL; only this cpu updates it,
+ * incrementing lock before and after */
+struct op_rdpmc_page *op_rdpmc_page(void);
 #endif // RRPROFILE
 
 #endif /* OP_X86_MODEL_H */